@@ -45,6 +45,14 @@ public:
     std::set<uint32_t> _wantedUserids;
     size_t _idx;
     bool _wantsHome {true};
+
+    // keep vector capacity between lookups
+    void reset() {
+      _data.clear();
+      _wantedUserids.clear();
+      _idx = 0;
+      _wantsHome = true;
+    }
   };
 
   /**
@@ -57,43 +65,42 @@ public:
    */
   void prepare(SPQueryContext context) override {
 
-    // make state
-    
-    auto spState = std::make_shared<MyState>();
-    context->setUserData(spState);
+    // reuse state, reset for this prepare()
+
+    MyState &state = context->state<MyState>();
 
     // gather filter constraints
 
-    for (auto constraint : context->getConstraints()) {
+    for (auto &constraint : context->getConstraintSpan()) {
       if (constraint.columnId == FUSERID && constraint.op == OP_EQ) {
-        spState->_wantedUserids.insert(constraint.value);
+        state._wantedUserids.insert(constraint.value);
       }
     }
 
     // optimize: check which columns are being requested
 
-    if (context->getRequestedColumns().count(FHOME) == 0) {
-      spState->_wantsHome = false;
+    if (!context->isColumnRequested(FHOME)) {
+      state._wantsHome = false;
     }
 
     // filter our data
-    if (spState->_wantedUserids.empty()) {
-      os_enum_users(spState->_data);
+    if (state._wantedUserids.empty()) {
+      os_enum_users(state._data);
     } else {
-      for (auto userid : spState->_wantedUserids) {
+      for (auto userid : state._wantedUserids) {
         RawData tmp;
         if (0 == os_get_user_by_id(userid, tmp)) {
-          spState->_data.push_back(tmp);
+          state._data.push_back(tmp);
         }
       }
     }
   }
 
   bool next(vsqlite::SPQueryContext context, DynMap &row) override {
-    std::shared_ptr<MyState> spState = std::static_pointer_cast<MyState>(context->getUserData());
+    MyState &state = context->state<MyState>();
 
-    while (spState->_idx < spState->_data.size()) {
-      RawData &pData = spState->_data[spState->_idx++];
+    while (state._idx < state._data.size()) {
+      RawData &pData = state._data[state._idx++];
 
 
       row[FUSERID] = pData.id;
@@ -101,7 +108,7 @@ public:
 
       // optimize : if 'home' column not in query, no need to call.
 
-      if (spState->_wantsHome) {
+      if (state._wantsHome) {
         row[FHOME] = os_get_user_home(pData.id);
       }
 
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "vsqlite.h"
+
+/*
+ * GeneratorTable : a VirtualTable that produces rows one at a time,
+ * resuming where the last row was yielded, instead of building all
+ * rows in prepare().
+ *
+ *   struct MyGen : public vsqlite::GeneratorState {
+ *     uint32_t uid;
+ *   };
+ *
+ *   class UsersTable : public vsqlite::GeneratorTable<MyGen> {
+ *     bool generate(vsqlite::SPQueryContext context, MyGen &gen, vsqlite::Row &row) override {
+ *       VSQLITE_GEN_BEGIN(gen);
+ *       for (gen.uid = 0; gen.uid < 1000; gen.uid++) {
+ *         row[FUID] = gen.uid;
+ *         VSQLITE_GEN_YIELD(gen);
+ *       }
+ *       VSQLITE_GEN_END(gen);
+ *     }
+ *   };
+ *
+ * The macros form a stackless state machine (C++11 has no coroutines).
+ * Local variables do not survive a yield; keep loop variables in the
+ * state.  Do not yield from inside a nested switch statement.  The
+ * resume point is the line number, so put at most one
+ * VSQLITE_GEN_YIELD on a line, a second one fails to compile with a
+ * duplicate case label.  __COUNTER__ is not used because it differs
+ * between translation units that include the same generate().
+ */
+
+namespace vsqlite {
+
+/*
+ * Base for generator state.  The state is the cursor's
+ * QueryContext::state<T>(), reset for each prepare().  If you
+ * give it a reset() method, call restart() from it.
+ */
+struct GeneratorState {
+  void restart() { _genLine = 0; }
+
+  int _genLine {0};  // resume point, -1 when done
+};
+
+#define VSQLITE_GEN_BEGIN(G) switch ((G)._genLine) { case 0:
+
+#define VSQLITE_GEN_YIELD(G) \
+  do { (G)._genLine = __LINE__; return true; case __LINE__:; } while (0)
+
+#define VSQLITE_GEN_END(G) } (G)._genLine = -1; return false
+
+template <typename State>
+class GeneratorTable : public VirtualTable {
+public:
+  virtual ~GeneratorTable() {}
+
+  /**
+   * Optional, called from prepare() with freshly reset state.
+   */
+  virtual void start(SPQueryContext context, State &state) {}
+
+  /**
+   * Fill row and VSQLITE_GEN_YIELD, once per row.
+   * @returns true if row has data, false when done.
+   */
+  virtual bool generate(SPQueryContext context, State &state, Row &row) = 0;
+
+  void prepare(SPQueryContext context) override {
+    start(context, context->state<State>());
+  }
+
+  bool nextRow(SPQueryContext context, Row &row) override {
+    State &state = context->state<State>();
+    if (state._genLine < 0) {
+      return false;
+    }
+    return generate(context, state, row);
+  }
+};
+
+} // namespace vsqlite
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "vsqlite.h"
+
+#include <stdio.h>
+#include <type_traits>
+
+/*
+ * StaticTable : a VirtualTable over a plain struct.
+ *
+ *   struct UserRow { uint32_t uid; std::string name; };
+ *
+ *   class UsersTable : public vsqlite::StaticTable<UserRow,
+ *         VSQLITE_FIELD(UserRow, uid), VSQLITE_FIELD(UserRow, name)> {
+ *   public:
+ *     UsersTable() : StaticTable("users", { {"uid", vsqlite::INDEXED}, {"name"} }) {}
+ *     void generate(vsqlite::SPQueryContext context, std::vector<UserRow> &rows) override {
+ *       ...
+ *     }
+ *   };
+ *
+ * Column types come from the member types.  Values are written to
+ * sqlite straight from the struct, without DynMap or DynVal.  The
+ * Row is only filled when vsqlite needs it, see isRowNeeded().
+ */
+
+namespace vsqlite {
+
+/*
+ * A column bound to a struct member at compile time.
+ * Use VSQLITE_FIELD(RowStruct, member).
+ */
+template <typename MemberPtr, MemberPtr P>
+struct Field;
+
+template <typename R, typename T, T R::*P>
+struct Field<T R::*, P> {
+  typedef R row_type;
+  typedef T value_type;
+  static const T &get(const R &row) { return row.*P; }
+};
+
+#define VSQLITE_FIELD(ROW, MEMBER) vsqlite::Field<decltype(&ROW::MEMBER), &ROW::MEMBER>
+
+namespace detail {
+
+  // DynType for a member type
+
+  template <typename T> struct FieldType;
+  template <> struct FieldType<bool>        { static const DynType value = TUINT8; };
+  template <> struct FieldType<int8_t>      { static const DynType value = TINT8; };
+  template <> struct FieldType<uint8_t>     { static const DynType value = TUINT8; };
+  template <> struct FieldType<int16_t>     { static const DynType value = TINT16; };
+  template <> struct FieldType<uint16_t>    { static const DynType value = TUINT16; };
+  template <> struct FieldType<int32_t>     { static const DynType value = TINT32; };
+  template <> struct FieldType<uint32_t>    { static const DynType value = TUINT32; };
+  template <> struct FieldType<int64_t>     { static const DynType value = TINT64; };
+  template <> struct FieldType<uint64_t>    { static const DynType value = TUINT64; };
+  template <> struct FieldType<float>       { static const DynType value = TFLOAT32; };
+  template <> struct FieldType<double>      { static const DynType value = TFLOAT64; };
+  template <> struct FieldType<std::string> { static const DynType value = TSTRING; };
+  template <> struct FieldType<std::vector<uint8_t> > { static const DynType value = TBYTES; };
+
+  // write member value to sqlite
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value>::type
+  writeValue(ColumnResult &result, const T &value) { result.setInt64((int64_t)value); }
+
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type
+  writeValue(ColumnResult &result, const T &value) { result.setDouble((double)value); }
+
+  inline void writeValue(ColumnResult &result, const std::string &value) {
+    result.setText(value.data(), value.size());
+  }
+  inline void writeValue(ColumnResult &result, const std::vector<uint8_t> &value) {
+    result.setBlob(value.data(), value.size());
+  }
+
+  template <typename RowT, typename F>
+  void writeField(const RowT &row, ColumnResult &result) {
+    writeValue(result, F::get(row));
+  }
+
+  // copy member value to a Row slot
+
+  template <typename T>
+  void readValue(DynVal &dest, const T &value) { dest = value; }
+
+  inline void readValue(DynVal &dest, const bool &value) { dest = (uint8_t)(value ? 1 : 0); }
+
+  template <typename RowT, typename F>
+  void readField(const RowT &row, DynVal &dest) {
+    readValue(dest, F::get(row));
+  }
+}
+
+template <typename RowT, typename... Cols>
+class StaticTable : public VirtualTable {
+public:
+  static const size_t NUM_COLUMNS = sizeof...(Cols);
+
+  struct ColumnSpec {
+    std::string name;
+    uint32_t options;
+    std::string description;
+  };
+
+  /*
+   * specs gives name and ColOpt options for each of Cols, in order.
+   * With any other number of specs the table has no columns,
+   * and vsqlite.add() fails.
+   */
+  StaticTable(const std::string &tableName, const std::vector<ColumnSpec> &specs) : _def() {
+    static const DynType types[] = { detail::FieldType<typename Cols::value_type>::value... };
+
+    _def.schemaId = std::make_shared<SchemaId>(tableName);
+    if (specs.size() != NUM_COLUMNS) {
+      fprintf(stderr, "StaticTable ERROR: '%s' has %d column specs for %d fields\n", tableName.c_str(), (int)specs.size(), (int)NUM_COLUMNS);
+      return;
+    }
+    for (size_t i=0; i < NUM_COLUMNS; i++) {
+      _fields.push_back(FieldDef::alloc(types[i], specs[i].name));
+      _def.columns.push_back({_fields[i], specs[i].options, specs[i].description});
+    }
+  }
+  virtual ~StaticTable() {}
+
+  const TableDef &getTableDef() const override {
+    return _def;
+  }
+
+  // FieldDef of column i, for comparing with Constraint.columnId
+  const SPFieldDef &field(size_t i) const {
+    return _fields[i];
+  }
+
+  /**
+   * Fill rows for this prepare().  rows is empty on entry,
+   * and keeps its capacity between calls.
+   */
+  virtual void generate(SPQueryContext context, std::vector<RowT> &rows) = 0;
+
+  void prepare(SPQueryContext context) override {
+    ScanState &state = context->state<ScanState>();
+    generate(context, state.rows);
+  }
+
+  bool nextRow(SPQueryContext context, Row &row) override {
+    ScanState &state = context->state<ScanState>();
+    if (state.next >= state.rows.size()) {
+      return false;
+    }
+    state.current = state.next++;
+    if (context->isRowNeeded()) {
+      typedef void (*reader_fn)(const RowT &, DynVal &);
+      static const reader_fn readers[] = { &detail::readField<RowT, Cols>... };
+      for (size_t i=0; i < NUM_COLUMNS; i++) {
+        readers[i](state.rows[state.current], row.at(i));
+      }
+    }
+    return true;
+  }
+
+  bool writeColumn(SPQueryContext context, size_t colIdx, ColumnResult &result) override {
+    typedef void (*writer_fn)(const RowT &, ColumnResult &);
+    static const writer_fn writers[] = { &detail::writeField<RowT, Cols>... };
+
+    ScanState &state = context->state<ScanState>();
+    if (colIdx >= NUM_COLUMNS || state.current >= state.rows.size()) {
+      return false;
+    }
+    writers[colIdx](state.rows[state.current], result);
+    return true;
+  }
+
+protected:
+  TableDef _def;
+  std::vector<SPFieldDef> _fields;
+
+private:
+  struct ScanState {
+    std::vector<RowT> rows;
+    size_t next {0};
+    size_t current {0};
+
+    void reset() {
+      rows.clear();
+      next = 0;
+      current = 0;
+    }
+  };
+};
+
+} // namespace vsqlite
@@ -5,6 +5,7 @@
 #include <string>
 #include <memory>
 #include <set>
+#include <unordered_map>
 
 #include <dynobj.hpp>
 
@@ -19,6 +20,9 @@ enum ColOpt {
   ,REQUIRED   = (1 << 2)
   ,ADDITIONAL = (1 << 3)
   ,HIDDEN     = (1 << 4)
+  ,UNIQUE     = (1 << 5)   // OP_EQ lookup returns at most one row
+  ,BATCH_IN   = (1 << 6)   // deliver whole IN (...) list to one prepare()
+  ,LAZY       = (1 << 7)   // value computed on read, see VirtualTable::getColumnValue()
   ,ALIAS      = (1 << 8)
 };
 
@@ -33,6 +37,13 @@ enum ConstraintOp {
   ,OP_LIKE = 65
   ,OP_GLOB = 66
   ,OP_REGEX = 67
+  ,OP_NE = 68
+  ,OP_ISNOT = 69
+  ,OP_ISNOTNULL = 70 // value is not valid()
+  ,OP_ISNULL = 71    // value is not valid()
+  ,OP_IS = 72
+  ,OP_LIMIT = 73     // sqlite 3.38+, see QueryContext::getRowLimitHint()
+  ,OP_OFFSET = 74
 };
 
 struct ColumnDef {
@@ -42,17 +53,51 @@ struct ColumnDef {
   SPFieldDef aliased;
   // ops other than OP_EQ need to be added explicitly
   std::set<ConstraintOp> indexOpsImplemented;
+  // approximate rows returned by a lookup on this column, 0 if unknown
+  int64_t estimatedRows;
+  // index ops the table evaluates exactly. sqlite will not re-check
+  // rows returned for these constraints.
+  std::set<ConstraintOp> exactOps;
 };
 
 typedef std::shared_ptr<ColumnDef> SPColumnDef;
 
+/*
+ * A multi-column index, e.g. (uid, path).  Lookups are only
+ * offered to sqlite when every column is constrained, with
+ * OP_EQ on all but the last column.  Columns only need
+ * ColOpt::INDEXED if they can also be looked up on their own.
+ */
+struct IndexDef {
+  std::vector<SPFieldDef> columns;
+  uint32_t options;        // ColOpt::UNIQUE
+  int64_t estimatedRows;   // rows returned by a lookup, 0 if unknown
+};
+
+/*
+ * One term of a row ordering.
+ */
+struct OrderTerm {
+  SPFieldDef columnId;
+  bool desc;
+};
+typedef std::vector<OrderTerm> Ordering;
+
 /*
  * The TableDef is the static definition of your table schema.
+ * Value-initialize a TableDef member, e.g. _def() in the
+ * constructor, so hints left unset, like estimatedRows, are 0.
  */
 struct TableDef {
   SPSchemaId schemaId;
   std::vector<ColumnDef> columns;
-  std::vector<std::string> table_attrs;  // CACHEABLE,EVENT
+  std::vector<std::string> table_attrs;  // CACHEABLE (per-statement snapshots),EVENT,PIPELINE
+  int64_t estimatedRows;  // approximate rows in a full scan, 0 if unknown
+  // Orderings next() can return rows in.  When a query's ORDER BY
+  // matches one, sqlite skips its sort step and prepare() is told
+  // which one via QueryContext::getOrderingIndex().
+  std::vector<Ordering> orderings;
+  std::vector<IndexDef> indexes;  // composite indexes
 };
 
 struct Constraint {
@@ -61,6 +106,107 @@ struct Constraint {
   DynVal value;
 };
 
+/*
+ * Non-owning view of the constraints held by a QueryContext.
+ * Valid until the next prepare() on the same context.
+ */
+class ConstraintSpan {
+public:
+  ConstraintSpan() {}
+  ConstraintSpan(const Constraint *data, size_t size) : _data(data), _size(size) {}
+
+  const Constraint *begin() const { return _data; }
+  const Constraint *end() const { return _data + _size; }
+  const Constraint &operator[](size_t i) const { return _data[i]; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+private:
+  const Constraint *_data {nullptr};
+  size_t _size {0};
+};
+
+/*
+ * OP_EQ, OP_GT, OP_GE, OP_LT and OP_LE constraints on one column,
+ * merged into a single interval.  A bound that is not valid()
+ * is unbounded.
+ */
+struct ColumnRange {
+  SPFieldDef columnId;
+  DynVal lower;
+  bool lowerInclusive;
+  DynVal upper;
+  bool upperInclusive;
+};
+
+/*
+ * A constraint as seen while sqlite is planning a query.
+ * The value is not known until prepare().
+ */
+struct IndexConstraint {
+  SPFieldDef columnId;
+  ConstraintOp op;
+};
+
+/*
+ * Planner estimates for a set of index constraints.
+ * A zero cost or rows value leaves sqlite's default in place.
+ */
+struct IndexEstimate {
+  double cost;      // relative to a linear scan of 'cost' rows
+  int64_t rows;     // rows expected from prepare() + next()
+  bool unique;      // at most one row will be returned
+};
+
+/*
+ * One bit per TableDef.columns entry, by position.
+ */
+class ColumnBitmap {
+public:
+  ColumnBitmap() {}
+  explicit ColumnBitmap(size_t numColumns) : _numColumns(numColumns), _words((numColumns + 63) / 64, 0) {}
+
+  void set(size_t colIdx) {
+    if (colIdx < _numColumns) { _words[colIdx / 64] |= (1ULL << (colIdx % 64)); }
+  }
+  bool test(size_t colIdx) const {
+    return colIdx < _numColumns && (_words[colIdx / 64] & (1ULL << (colIdx % 64))) != 0;
+  }
+  size_t count() const {
+    size_t n = 0;
+    for (uint64_t w : _words) {
+      for (; w != 0; w &= (w - 1)) { n++; }
+    }
+    return n;
+  }
+  bool empty() const {
+    for (uint64_t w : _words) {
+      if (w != 0) { return false; }
+    }
+    return true;
+  }
+  size_t size() const { return _numColumns; }
+  void clear() {
+    for (uint64_t &w : _words) { w = 0; }
+  }
+
+private:
+  size_t _numColumns {0};
+  std::vector<uint64_t> _words;
+};
+
+namespace detail {
+  // QueryContext::state<T>() reset, T::reset() if available, else T()
+  template <typename T>
+  auto resetState(T &state, int) -> decltype(state.reset(), void()) { state.reset(); }
+  template <typename T>
+  void resetState(T &state, long) { state = T(); }
+
+  // type-erased resetState(), stored with the state's type
+  template <typename T>
+  void resetStateOf(void *state) { resetState(*static_cast<T*>(state), 0); }
+}
+
 /*
  * A VirtualTable.prepare() method will be called to
  * filter a set of data based on the QueryContext.
@@ -73,6 +219,16 @@ struct QueryContext {
    */
   virtual std::vector<Constraint> getConstraints() = 0;
 
+  /**
+   * Same as getConstraints(), without copying.
+   */
+  virtual ConstraintSpan getConstraintSpan() = 0;
+
+  /**
+   * First constraint on columnId with op, or nullptr.
+   */
+  virtual const Constraint *findConstraint(const SPFieldDef &columnId, ConstraintOp op) = 0;
+
   /**
    * A list of columns being requested by the current
    * query.  This allows table implementations to optimize
@@ -80,15 +236,201 @@ struct QueryContext {
    */
   virtual std::set<SPFieldDef> getRequestedColumns() = 0;
 
+  /**
+   * Same as getRequestedColumns(), indexed by position in
+   * TableDef.columns, without copying.  Aliased columns mark
+   * the column they alias.  sqlite only tracks the first 63
+   * columns individually, so if any later column is used,
+   * all columns from 63 on are marked.
+   */
+  virtual const ColumnBitmap &getRequestedColumnBits() = 0;
+
+  /**
+   * true if the query reads columnId.  Same rules as
+   * getRequestedColumnBits().  An ALIAS column is requested
+   * when the column it aliases is.
+   */
+  virtual bool isColumnRequested(const SPFieldDef &columnId) = 0;
+
+  /**
+   * true if the query reads no columns, e.g. SELECT count(*).
+   * nextRow() can then return true without filling the row.
+   */
+  virtual bool isCountOnly() = 0;
+
+  /**
+   * false if sqlite reads this scan's rows through writeColumn()
+   * only, so nextRow() need not fill the Row.  true when rows are
+   * produced on worker threads, indexed or kept by vsqlite.
+   */
+  virtual bool isRowNeeded() = 0;
+
+  /**
+   * Comparison constraints pushed down for columnId, merged into
+   * one interval.  Returns false if there are none.  If the merged
+   * interval is empty, prepare() is not called at all.  Columns
+   * compared with a collation other than BINARY, or with a value
+   * sqlite converts by column affinity (text to a number column,
+   * say), get no range; use getConstraints() for those.
+   */
+  virtual bool getRange(const SPFieldDef &columnId, ColumnRange &range) = 0;
+
+  /**
+   * Index into TableDef.orderings that rows must be returned in,
+   * or -1 if sqlite will sort the rows itself.
+   */
+  virtual int getOrderingIndex() = 0;
+
+  /**
+   * Index into TableDef.indexes whose columns are all constrained,
+   * or -1 if none matched.
+   */
+  virtual int getIndexIndex() = 0;
+
+  /**
+   * Maximum number of rows sqlite will read from this scan
+   * (LIMIT + OFFSET), or -1 if unknown.  Only provided when all
+   * other constraints are handled exactly by the table, so
+   * expensive generators can stop early.
+   */
+  virtual int64_t getRowLimitHint() = 0;
+
+  /**
+   * Partition this prepare() should scan, from 0 to
+   * VirtualTable::getPartitionCount() - 1, or -1 for all rows.
+   */
+  virtual int getPartition() = 0;
+
   /*
    * Table implementations can attach it's own state to the context,
    * which will follow from prepare() to each next() call.
    */
   virtual void setUserData(std::shared_ptr<void> spTablePrivate) = 0;
   virtual std::shared_ptr<void> getUserData() = 0;
+
+  /*
+   * Per-cursor table state, kept with the context and reused
+   * instead of reallocated.  The first call after each prepare()
+   * resets it, using T::reset() if T has one, else T().  It is
+   * also reset when the cursor is done with the context.
+   * Cheaper than setUserData() for lookups that call prepare()
+   * once per IN value.
+   */
+  template <typename T>
+  T &state() {
+    if (_stateType != stateTag<T>()) {
+      _state = std::make_shared<T>();
+      _stateType = stateTag<T>();
+      _stateReset = &detail::resetStateOf<T>;
+    } else if (_stateStale) {
+      detail::resetState(*static_cast<T*>(_state.get()), 0);
+    }
+    _stateStale = false;
+    return *static_cast<T*>(_state.get());
+  }
+
+protected:
+  template <typename T>
+  static const void *stateTag() { static const char tag = 0; return &tag; }
+
+  std::shared_ptr<void> _state;
+  const void *_stateType {nullptr};
+  void (*_stateReset)(void *) {nullptr};
+  bool _stateStale {false};      // set before each prepare()
 };
 typedef std::shared_ptr<QueryContext> SPQueryContext;
 
+/*
+ * Row filled in by VirtualTable::nextRow().  There is one value slot
+ * per TableDef.columns entry.  The slots are kept from row to row
+ * and only overwritten, so a scan does not allocate for every row.
+ */
+class Row {
+public:
+  Row() {}
+  Row(const std::unordered_map<const FieldDef*, int> *columnIndex, size_t numColumns)
+    : _columnIndex(columnIndex), _slots(numColumns), _set(numColumns) {}
+
+  /*
+   * Slot for columnId, marked as set.  Columns not in the
+   * TableDef go to the legacy map.
+   */
+  DynVal &operator[](const SPFieldDef &columnId) {
+    if (_columnIndex != nullptr) {
+      auto it = _columnIndex->find(columnId.get());
+      if (it != _columnIndex->end()) {
+        return at(it->second);
+      }
+    }
+    return _legacy[columnId];
+  }
+
+  // slot by position in TableDef.columns, marked as set
+  DynVal &at(size_t colIdx) {
+    _set.set(colIdx);
+    return _slots[colIdx];
+  }
+
+  // value at position colIdx, nullptr if not set for this row
+  const DynVal *get(size_t colIdx) const {
+    return (_set.test(colIdx) ? &_slots[colIdx] : nullptr);
+  }
+  DynVal *get(size_t colIdx) {
+    return (_set.test(colIdx) ? &_slots[colIdx] : nullptr);
+  }
+
+  // value of columnId for this row, from its slot or the legacy map
+  const DynVal *find(const SPFieldDef &columnId) const {
+    if (_columnIndex != nullptr) {
+      auto it = _columnIndex->find(columnId.get());
+      if (it != _columnIndex->end() && _set.test(it->second)) {
+        return &_slots[it->second];
+      }
+    }
+    auto fit = _legacy.find(columnId);
+    return (fit == _legacy.end() ? nullptr : &fit->second);
+  }
+
+  bool empty() const { return _set.empty() && _legacy.empty(); }
+
+  // unmark all slots.  Values are kept for reuse.
+  void clear() {
+    _set.clear();
+    if (!_legacy.empty()) { _legacy.clear(); }
+  }
+
+  // values set by VirtualTable::next(), keyed by column
+  DynMap &legacy() { return _legacy; }
+  const DynMap &legacy() const { return _legacy; }
+
+private:
+  const std::unordered_map<const FieldDef*, int> *_columnIndex {nullptr};
+  std::vector<DynVal> _slots;
+  ColumnBitmap _set;
+  DynMap _legacy;
+};
+
+/*
+ * Receives one column value, see VirtualTable::writeColumn().
+ */
+struct ColumnResult {
+  virtual void setNull() = 0;
+  virtual void setInt64(int64_t value) = 0;
+  virtual void setDouble(double value) = 0;
+  virtual void setText(const char *value, size_t len) = 0;
+  virtual void setBlob(const void *value, size_t len) = 0;
+};
+
+/*
+ * Receives rows from VirtualTable::lookupBatch(), by key.
+ */
+struct BatchRows {
+  /*
+   * New, empty row for keys[keyIdx].  Valid until the next call.
+   */
+  virtual Row &addRow(size_t keyIdx) = 0;
+};
+
 enum TLStatus {
   TL_STATUS_OK = 0,
   TL_STATUS_ABORT = 99
@@ -113,10 +455,79 @@ struct VirtualTable {
    * Called for each row of data.
    * The caller (vsqlite layer) will determine if next()
    * provides data if returns 0 OR row.empty().
+   * Not called if the table overrides nextRow().
    * @param data Gets set when data is available (out param)
    * @returns true if data is available, false if no more data.
    */
-  virtual bool next(SPQueryContext context, DynMap &row) = 0;
+  virtual bool next(SPQueryContext context, DynMap &row) { return false; }
+
+  /**
+   * Called for each row of data.  'row' is reused between calls;
+   * only assign the columns of this row.  Unlike next(), a row with
+   * no columns set is still a row.  The default calls next().
+   * @returns true if data is available, false if no more data.
+   */
+  virtual bool nextRow(SPQueryContext context, Row &row) {
+    DynMap &m = row.legacy();
+    return next(context, m) && !m.empty();
+  }
+
+  /**
+   * Write column colIdx (position in TableDef.columns) of the
+   * current row straight to sqlite, for tables that keep rows in
+   * their own structures (see static_table.h).  Called before
+   * the Row is consulted.  Not called when rows are produced on
+   * worker threads (PIPELINE, PARALLEL_LOOKUP, partitions,
+   * PREFETCH) or kept by vsqlite (AUTO_INDEX, CACHEABLE); then
+   * QueryContext::isRowNeeded() is true and nextRow() must fill
+   * the Row.
+   * @returns false to fall back to the Row.
+   */
+  virtual bool writeColumn(SPQueryContext context, size_t colIdx, ColumnResult &result) { return false; }
+
+  /**
+   * Compute a ColOpt::LAZY column of the current row.  Called only
+   * when sqlite reads the column, e.g. after other constraints on
+   * the row have passed.  The value is kept for the rest of the row,
+   * so repeated reads do not call again.
+   * @param row The row returned by next() or nextRow().
+   * @returns false to leave the column NULL.
+   */
+  virtual bool getColumnValue(SPQueryContext context, const Row &row, const SPFieldDef &columnId, DynVal &value) { return false; }
+
+  /**
+   * Optional planner hint, called while sqlite compares query plans.
+   * 'est' is pre-filled from TableDef.estimatedRows and the
+   * ColumnDef estimates of the constrained columns.  Tables that
+   * know better (e.g. current row counts) can adjust it.
+   * Results are cached per constraint shape, so estimate() should
+   * return the same answer for the same constraints.
+   * @param constraints The constraints prepare() would receive,
+   *        empty for a full scan.
+   */
+  virtual void estimate(const std::vector<IndexConstraint> &constraints, IndexEstimate &est) const { }
+
+  /**
+   * For tables with "PARTITIONED" or "PARTITIONED_ORDERED" in
+   * table_attrs.  Called on sqlite's thread in place of prepare().
+   * prepare() and next() are then called concurrently, once per
+   * partition, on copies of context (see getPartition()).
+   * @returns number of partitions, 0 or 1 to scan as usual.
+   */
+  virtual size_t getPartitionCount(SPQueryContext context) { return 0; }
+
+  /**
+   * For tables with "BATCH_LOOKUP" in table_attrs.  When this table
+   * is looked up once per row of an outer PREFETCH table in a join,
+   * vsqlite collects the next outer join keys and calls this once
+   * per batch of them, instead of prepare() per outer row.  Keys of
+   * outer rows sqlite goes on to reject may be included.  The rows for each key must be the
+   * ones prepare() would give for OP_EQ on columnId.
+   * @param context No constraints, requested columns as for prepare().
+   * @returns false to fall back to prepare() per key.
+   */
+  virtual bool lookupBatch(SPQueryContext context, const SPFieldDef &columnId,
+                           const std::vector<DynVal> &keys, BatchRows &rows) { return false; }
 };
 typedef std::shared_ptr<VirtualTable> SPVirtualTable;
 
@@ -7,6 +7,8 @@
 namespace vsqlite {
   int VSQLiteImpl::query(const std::string sql, QueryListener &listener /*std::vector<DynMap> &results*/) {
 
+      std::shared_ptr<void> spStatement = _beginStatement();
+
       sqlite3_stmt *pStmt = nullptr;
       int rv = sqlite3_prepare_v2(_db, sql.c_str(), sql.size(), &pStmt, nullptr);
       if (rv != SQLITE_OK) {
@@ -45,6 +47,7 @@ namespace vsqlite {
       }
 
       sqlite3_finalize(pStmt);
+      spStatement.reset();
 
       return 0;
     }
@@ -60,7 +63,7 @@ namespace vsqlite {
    }
    switch(sqltype) {
      case SQLITE_INTEGER:
-       dest = sqlite3_value_int(val);
+       dest = (int64_t)sqlite3_value_int64(val);
        break;
      case SQLITE_FLOAT:
        dest = sqlite3_value_double(val);
@@ -333,6 +336,8 @@ namespace vsqlite {
         if (colDef.options & ColOpt::REQUIRED) { s += " REQUIRED"; }
         if (colDef.options & ColOpt::INDEXED) { s += " INDEXED"; }
         if (colDef.options & ColOpt::ADDITIONAL) { s += " ADDITIONAL"; }
+        if (colDef.options & ColOpt::UNIQUE) { s += " UNIQUE"; }
+        if (colDef.options & ColOpt::LAZY) { s += " LAZY"; }
       }
     }
     s += ")";
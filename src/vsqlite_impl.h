@@ -4,6 +4,8 @@
 #include <sqlite3.h>
 
 namespace vsqlite {
+  struct RunningStatement;
+
   class VSQLiteImpl : public VSQLite {
   public:
     VSQLiteImpl();
@@ -24,6 +26,13 @@ namespace vsqlite {
 
     void remove(SPVirtualTable spVirtualTable) override;
 
+    //--------------------------------------------------------------------
+    // innermost statement being run by query(), or nullptr
+    //--------------------------------------------------------------------
+    RunningStatement *currentStatement() {
+      return (_statements.empty() ? nullptr : _statements.back());
+    }
+
   private:
 
     // ==================== private functions ===============
@@ -42,10 +51,17 @@ namespace vsqlite {
     //--------------------------------------------------------------------
     bool _populateColumns(sqlite3_stmt *pStmt, std::vector<SPFieldDef> &columns);
 
+    //--------------------------------------------------------------------
+    // state the tables keep for one statement, from before prepare
+    // until after finalize.  Dropped when the handle is released.
+    //--------------------------------------------------------------------
+    std::shared_ptr<void> _beginStatement();
+
     // member variables
     sqlite3* _db {nullptr};
     std::vector<SPAppFunction> _funcs;
     std::vector<SPVirtualTable> _tables;
+    std::vector<RunningStatement*> _statements;  // nested by listener callbacks
   };
 
 
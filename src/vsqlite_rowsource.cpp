@@ -0,0 +1,478 @@
+#include "vsqlite_rowsource.h"
+
+namespace vsqlite {
+
+//----------------------------------------------------------------------
+// starts the worker thread, idle until start()
+//----------------------------------------------------------------------
+PipelineWorker::PipelineWorker(VirtualTable *table, const Row &prototype, size_t capacity)
+    : _table(table), _ring(capacity > 0 ? capacity : 1, prototype) {
+  _thread = std::thread(&PipelineWorker::run, this);
+}
+
+PipelineWorker::~PipelineWorker() {
+  stop();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _shutdown = true;
+  }
+  _cv.notify_all();
+  _thread.join();
+}
+
+//----------------------------------------------------------------------
+// hand the worker a new scan.  Called with the worker idle, so the
+// ring and flags are not in use.
+//----------------------------------------------------------------------
+void PipelineWorker::start(SPQueryContext context) {
+  _head.store(0);
+  _tail.store(0);
+  _done.store(false);
+  _cancelled.store(false);
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _context = context;
+    _pending = true;
+    _busy = true;
+  }
+  _cv.notify_all();
+}
+
+//----------------------------------------------------------------------
+// wake the other side, if it is parked.  waiting is set before the
+// parked side re-checks the ring, so either it sees our update or
+// we see its flag.
+//----------------------------------------------------------------------
+void PipelineWorker::wake(std::atomic<bool> &waiting) {
+  if (waiting.load()) {
+    { std::lock_guard<std::mutex> lock(_mutex); }
+    _cv.notify_all();
+  }
+}
+
+//----------------------------------------------------------------------
+// worker thread, one scan per start()
+//----------------------------------------------------------------------
+void PipelineWorker::run() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+    _cv.wait(lock, [&] { return _shutdown || _pending; });
+    if (_shutdown) {
+      break;
+    }
+    _pending = false;
+    lock.unlock();
+
+    produce();
+
+    lock.lock();
+    _busy = false;
+    _cv.notify_all();
+  }
+}
+
+//----------------------------------------------------------------------
+// producer
+//----------------------------------------------------------------------
+void PipelineWorker::produce() {
+  if (!_cancelled.load()) {
+    _table->prepare(_context);
+  }
+
+  while (!_cancelled.load()) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+
+    // ring full, wait for consumer
+
+    if (tail - _head.load() >= _ring.size()) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _producerWaiting.store(true);
+      _cv.wait(lock, [&] { return _cancelled.load() || tail - _head.load() < _ring.size(); });
+      _producerWaiting.store(false);
+      continue;
+    }
+
+    Row &row = _ring[tail % _ring.size()];
+    row.clear();
+    if (!_table->nextRow(_context, row)) {
+      break;
+    }
+    _tail.store(tail + 1);
+    wake(_consumerWaiting);
+  }
+
+  _done.store(true);
+  wake(_consumerWaiting);
+}
+
+//----------------------------------------------------------------------
+// consumer, called from xFilter / xNext
+//----------------------------------------------------------------------
+bool PipelineWorker::next(Row &row) {
+  size_t head = _head.load(std::memory_order_relaxed);
+
+  if (_tail.load() == head) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _consumerWaiting.store(true);
+    _cv.wait(lock, [&] { return _tail.load() != head || _done.load(); });
+    _consumerWaiting.store(false);
+    if (_tail.load() == head) {
+      return false;
+    }
+  }
+
+  std::swap(row, _ring[head % _ring.size()]);
+  _head.store(head + 1);
+  wake(_producerWaiting);
+  return true;
+}
+
+//----------------------------------------------------------------------
+// stops producer between rows and waits until it is idle.  The
+// context is released, so the cursor can change or pool it.
+//----------------------------------------------------------------------
+void PipelineWorker::stop() {
+  _cancelled.store(true);
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.notify_all();
+  _cv.wait(lock, [&] { return !_busy; });
+  _context.reset();
+}
+
+//======================================================================
+// PipelineRowSource
+//======================================================================
+
+PipelineRowSource::~PipelineRowSource() {
+  cancel();
+}
+
+bool PipelineRowSource::next(Row &row) {
+  return _worker.next(row);
+}
+
+void PipelineRowSource::cancel() {
+  _worker.stop();
+}
+
+//======================================================================
+// OrderedParallelRowSource
+//======================================================================
+
+OrderedParallelRowSource::OrderedParallelRowSource(VirtualTable *table, std::vector<SPQueryContext> contexts,
+                                                 const Row &prototype, ThreadPool &pool, size_t window)
+    : _table(table), _lookups(contexts.size()), _prototype(prototype), _pool(pool), _window(window > 0 ? window : 1) {
+  _prototype.clear();
+  for (size_t i=0; i < contexts.size(); i++) {
+    _lookups[i].context = contexts[i];
+  }
+  submitAhead();
+}
+
+OrderedParallelRowSource::~OrderedParallelRowSource() {
+  cancel();
+}
+
+//----------------------------------------------------------------------
+// keep up to _window lookups queued or running past _current
+//----------------------------------------------------------------------
+void OrderedParallelRowSource::submitAhead() {
+  while (_submitted < _lookups.size() && _submitted < _current + _window) {
+    Lookup *pLookup = &_lookups[_submitted++];
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _running++;
+    }
+    _pool.submit([this, pLookup] { run(*pLookup); });
+  }
+}
+
+//----------------------------------------------------------------------
+// pool thread.  skips the lookup if cancelled before it starts.
+//----------------------------------------------------------------------
+void OrderedParallelRowSource::run(Lookup &lookup) {
+  if (!_cancelled.load()) {
+    _table->prepare(lookup.context);
+    while (!_cancelled.load()) {
+      lookup.rows.push_back(_prototype);
+      if (!_table->nextRow(lookup.context, lookup.rows.back())) {
+        lookup.rows.pop_back();
+        break;
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  lookup.done = true;
+  _running--;
+  _cv.notify_all();
+}
+
+//----------------------------------------------------------------------
+// consumer, called from xFilter / xNext
+//----------------------------------------------------------------------
+bool OrderedParallelRowSource::next(Row &row) {
+  while (_current < _lookups.size()) {
+    Lookup &lookup = _lookups[_current];
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [&] { return lookup.done; });
+    }
+    if (_rowIdx < lookup.rows.size()) {
+      std::swap(row, lookup.rows[_rowIdx++]);
+      return true;
+    }
+
+    // lookup used up, release its rows and context
+
+    lookup.rows = std::vector<Row>();
+    lookup.context.reset();
+    _current++;
+    _rowIdx = 0;
+    submitAhead();
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------
+// lookups already running finish their current row
+//----------------------------------------------------------------------
+void OrderedParallelRowSource::cancel() {
+  _cancelled.store(true);
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock, [this] { return _running == 0; });
+}
+
+//======================================================================
+// UnorderedParallelRowSource
+//======================================================================
+
+// rows a sweep collects before taking the lock to publish them
+#define SWEEP_BATCH_ROWS 16
+
+UnorderedParallelRowSource::UnorderedParallelRowSource(VirtualTable *table, std::vector<SPQueryContext> contexts,
+                                                       const Row &prototype, ThreadPool &pool, size_t capacity)
+    : _table(table), _sweeps(contexts.size()), _prototype(prototype), _pool(pool),
+      _capacity(capacity > 0 ? capacity : 1), _remaining(contexts.size()) {
+  _prototype.clear();
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (size_t i=0; i < contexts.size(); i++) {
+    _sweeps[i].context = contexts[i];
+    submit(&_sweeps[i]);
+  }
+}
+
+UnorderedParallelRowSource::~UnorderedParallelRowSource() {
+  cancel();
+}
+
+//----------------------------------------------------------------------
+// caller holds _mutex
+//----------------------------------------------------------------------
+void UnorderedParallelRowSource::submit(Sweep *pSweep) {
+  _running++;
+  _pool.submit([this, pSweep] { run(*pSweep); });
+}
+
+//----------------------------------------------------------------------
+// pool thread.  returns when the sweep is done, cancelled, or
+// enough rows are waiting for the cursor.
+//----------------------------------------------------------------------
+void UnorderedParallelRowSource::run(Sweep &sweep) {
+  bool finished = _cancelled.load();
+  if (!finished && !sweep.prepared) {
+    _table->prepare(sweep.context);
+    sweep.prepared = true;
+  }
+
+  std::vector<Row> batch;
+  while (!finished) {
+    batch.push_back(_prototype);
+    if (!_table->nextRow(sweep.context, batch.back())) {
+      batch.pop_back();
+      finished = true;
+    } else if (batch.size() < SWEEP_BATCH_ROWS) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &row : batch) {
+      _rows.push_back(std::move(row));
+    }
+    batch.clear();
+    _cv.notify_all();
+    if (!finished && (_cancelled.load() || _rows.size() >= _capacity)) {
+      if (!_cancelled.load()) {
+        _paused.push_back(&sweep);
+      }
+      _running--;
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _remaining--;
+  _running--;
+  sweep.context.reset();
+  _cv.notify_all();
+}
+
+//----------------------------------------------------------------------
+// consumer, called from xFilter / xNext
+//----------------------------------------------------------------------
+bool UnorderedParallelRowSource::next(Row &row) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+    _cv.wait(lock, [this] { return !_rows.empty() || !_paused.empty() || _remaining == 0; });
+
+    if (!_paused.empty() && _rows.size() <= _capacity / 2) {
+      std::vector<Sweep*> resume;
+      resume.swap(_paused);
+      for (Sweep *pSweep : resume) {
+        submit(pSweep);
+      }
+    }
+    if (!_rows.empty()) {
+      std::swap(row, _rows.front());
+      _rows.pop_front();
+      return true;
+    }
+    if (_remaining == 0) {
+      return false;
+    }
+  }
+}
+
+//----------------------------------------------------------------------
+// sweeps already running finish their current row
+//----------------------------------------------------------------------
+void UnorderedParallelRowSource::cancel() {
+  _cancelled.store(true);
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock, [this] { return _running == 0; });
+  _paused.clear();
+}
+
+//======================================================================
+// PrefetchScan
+//======================================================================
+
+PrefetchScan::PrefetchScan(VirtualTable *table, SPQueryContext context, const Row &prototype)
+    : _table(table), _context(context), _prototype(prototype) {
+  _prototype.clear();
+}
+
+//----------------------------------------------------------------------
+// the task keeps the scan alive until it has run
+//----------------------------------------------------------------------
+void PrefetchScan::start(ThreadPool &pool) {
+  _started = true;
+  auto self = shared_from_this();
+  pool.submit([self] { self->run(); });
+}
+
+//----------------------------------------------------------------------
+// pool thread
+//----------------------------------------------------------------------
+void PrefetchScan::run() {
+  if (!_cancelled.load()) {
+    _table->prepare(_context);
+    while (!_cancelled.load()) {
+      _rows.push_back(_prototype);
+      if (!_table->nextRow(_context, _rows.back())) {
+        _rows.pop_back();
+        break;
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _finished = true;
+  _cv.notify_all();
+}
+
+std::vector<Row> &PrefetchScan::wait() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock, [this] { return _finished || !_started; });
+  if (_cancelled.load()) {
+    _rows.clear();
+  }
+  return _rows;
+}
+
+bool PrefetchScan::next(Row &row) {
+  std::vector<Row> &rows = wait();
+  if (_rowIdx >= rows.size()) {
+    return false;
+  }
+  std::swap(row, rows[_rowIdx++]);
+  return true;
+}
+
+void PrefetchScan::cancel() {
+  _cancelled.store(true);
+  wait();
+  _context.reset();
+}
+
+//======================================================================
+// PrefetchRowSource
+//======================================================================
+
+PrefetchRowSource::~PrefetchRowSource() {
+  cancel();
+}
+
+bool PrefetchRowSource::next(Row &row) {
+  return _scan->next(row);
+}
+
+void PrefetchRowSource::cancel() {
+  _scan->cancel();
+}
+
+//======================================================================
+// SharedRowSource
+//======================================================================
+
+bool SharedRowSource::next(Row &row) {
+  if (_rowIdx >= _rows->size()) {
+    return false;
+  }
+  row = (*_rows)[_rowIdx++];
+  return true;
+}
+
+//======================================================================
+// RecordingRowSource
+//======================================================================
+
+bool RecordingRowSource::next(Row &row) {
+  if (_finished) {
+    return false;
+  }
+  bool more;
+  if (_inner) {
+    more = _inner->next(row);
+  } else {
+    row.clear();
+    more = _table->nextRow(_context, row);
+  }
+  if (more) {
+    _rows.push_back(row);
+    return true;
+  }
+  _finished = true;
+  _done(std::make_shared<const std::vector<Row> >(std::move(_rows)));
+  return false;
+}
+
+void RecordingRowSource::cancel() {
+  if (_inner) {
+    _inner->cancel();
+  }
+  _finished = true;
+  _rows.clear();
+}
+
+} // namespace vsqlite
@@ -0,0 +1,295 @@
+#pragma once
+
+#include "../include/vsqlite/vsqlite.h"
+#include "vsqlite_threadpool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace vsqlite {
+
+/*
+ * Where a cursor gets its rows from, when rows are not produced
+ * by calling the table's nextRow() on sqlite's thread.
+ */
+struct RowSource {
+  virtual ~RowSource() {}
+
+  /*
+   * Move the next row into row.  row's previous storage may be
+   * recycled by the source.
+   * @returns false when there are no more rows.
+   */
+  virtual bool next(Row &row) = 0;
+
+  /*
+   * Stop producing rows and wait for any worker threads.
+   * Must be called before the context is changed or released.
+   */
+  virtual void cancel() = 0;
+};
+
+/*
+ * Runs the table's prepare() and nextRow() on a worker thread
+ * (table_attrs "PIPELINE").  One worker serves every xFilter of a
+ * cursor, so a PIPELINE table on the inner side of a join does not
+ * start a thread per outer row.  Rows are handed to the cursor
+ * through a bounded single-producer, single-consumer ring.  Each
+ * side only locks when it has to wait for the other.
+ */
+class PipelineWorker {
+public:
+  PipelineWorker(VirtualTable *table, const Row &prototype, size_t capacity);
+  ~PipelineWorker();
+
+  /*
+   * Start producing rows for context.  The previous scan,
+   * if any, must have been stopped.
+   */
+  void start(SPQueryContext context);
+
+  bool next(Row &row);
+
+  /*
+   * Stop producing rows, waiting for the worker to go idle.
+   * A nextRow() in progress completes.
+   */
+  void stop();
+
+private:
+  void run();
+  void produce();
+  void wake(std::atomic<bool> &waiting);
+
+  VirtualTable *_table;
+  SPQueryContext _context;  // set by start(), read by the worker
+  std::vector<Row> _ring;
+
+  std::atomic<size_t> _head {0};   // rows taken by consumer
+  std::atomic<size_t> _tail {0};   // rows published by producer
+  std::atomic<bool> _done {false};
+  std::atomic<bool> _cancelled {false};
+
+  // parking, when the ring is empty or full, and idle between scans
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::atomic<bool> _consumerWaiting {false};
+  std::atomic<bool> _producerWaiting {false};
+  bool _pending {false};   // start() called, not yet picked up, guarded by _mutex
+  bool _busy {false};      // from start() until the scan ends, guarded by _mutex
+  bool _shutdown {false};  // guarded by _mutex
+
+  std::thread _thread;
+};
+
+/*
+ * Serves one scan of a cursor's PipelineWorker.
+ */
+class PipelineRowSource : public RowSource {
+public:
+  PipelineRowSource(PipelineWorker &worker, SPQueryContext context) : _worker(worker) {
+    _worker.start(context);
+  }
+  virtual ~PipelineRowSource();
+
+  bool next(Row &row) override;
+  void cancel() override;
+
+private:
+  PipelineWorker &_worker;
+};
+
+/*
+ * Runs one prepare() / nextRow() sweep per context on a thread pool
+ * (PARALLEL_LOOKUP values, PARTITIONED_ORDERED partitions), at most
+ * window of them ahead of the cursor.  Rows are served in context
+ * order, so the cursor sees the same rows, in the same order, as
+ * serial sweeps would give.
+ */
+class OrderedParallelRowSource : public RowSource {
+public:
+  OrderedParallelRowSource(VirtualTable *table, std::vector<SPQueryContext> contexts, const Row &prototype,
+                           ThreadPool &pool, size_t window);
+  virtual ~OrderedParallelRowSource();
+
+  bool next(Row &row) override;
+  void cancel() override;
+
+private:
+  struct Lookup {
+    SPQueryContext context;
+    std::vector<Row> rows;
+    bool done {false};
+  };
+
+  void submitAhead();
+  void run(Lookup &lookup);
+
+  VirtualTable *_table;
+  std::vector<Lookup> _lookups;
+  Row _prototype;
+  ThreadPool &_pool;
+  size_t _window;
+
+  size_t _submitted {0};  // lookups handed to the pool
+  size_t _current {0};    // lookup being served
+  size_t _rowIdx {0};     // next row of _current
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  size_t _running {0};    // submitted and not done, guarded by _mutex
+  std::atomic<bool> _cancelled {false};
+};
+
+/*
+ * Runs one prepare() / nextRow() sweep per context on a thread pool
+ * (PARTITIONED partitions), all at once.  Rows are served as they
+ * arrive, from any sweep.  Sweeps pause, giving their pool thread
+ * back, while capacity rows are waiting for the cursor; they never
+ * block a pool thread on sqlite.
+ */
+class UnorderedParallelRowSource : public RowSource {
+public:
+  UnorderedParallelRowSource(VirtualTable *table, std::vector<SPQueryContext> contexts, const Row &prototype,
+                             ThreadPool &pool, size_t capacity);
+  virtual ~UnorderedParallelRowSource();
+
+  bool next(Row &row) override;
+  void cancel() override;
+
+private:
+  struct Sweep {
+    SPQueryContext context;
+    bool prepared {false};
+  };
+
+  void submit(Sweep *pSweep);
+  void run(Sweep &sweep);
+
+  VirtualTable *_table;
+  std::vector<Sweep> _sweeps;
+  Row _prototype;
+  ThreadPool &_pool;
+  size_t _capacity;
+
+  // guarded by _mutex
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<Row> _rows;
+  std::vector<Sweep*> _paused;  // waiting for _rows to drain
+  size_t _running {0};          // submitted and not returned
+  size_t _remaining;            // sweeps not finished
+  std::atomic<bool> _cancelled {false};
+};
+
+/*
+ * A whole scan, run on the thread pool before sqlite reads the
+ * cursor it was started for (table_attrs "PREFETCH", and outer
+ * scans of BATCH_LOOKUP joins).
+ */
+class PrefetchScan : public std::enable_shared_from_this<PrefetchScan> {
+public:
+  PrefetchScan(VirtualTable *table, SPQueryContext context, const Row &prototype);
+
+  void start(ThreadPool &pool);
+
+  /*
+   * Wait for the scan to finish.
+   * @returns the rows, empty if cancelled.
+   */
+  std::vector<Row> &wait();
+
+  /*
+   * Swap the next row into 'row', waiting for the scan to finish.
+   * @returns false at the end.
+   */
+  bool next(Row &row);
+
+  /*
+   * Index into wait() of the first row next() has not returned.
+   */
+  size_t position() const { return _rowIdx; }
+
+  /*
+   * Skip the scan if not started yet, else stop it between rows,
+   * and wait.  Call before the table can go away.
+   */
+  void cancel();
+
+private:
+  void run();
+
+  VirtualTable *_table;
+  SPQueryContext _context;
+  Row _prototype;
+  std::vector<Row> _rows;
+  size_t _rowIdx {0};  // read by next() on sqlite's thread
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _started {false};
+  bool _finished {false};  // guarded by _mutex
+  std::atomic<bool> _cancelled {false};
+};
+
+/*
+ * Serves the rows of a PrefetchScan to the cursor that claimed it.
+ */
+class PrefetchRowSource : public RowSource {
+public:
+  PrefetchRowSource(std::shared_ptr<PrefetchScan> scan) : _scan(scan) {}
+  virtual ~PrefetchRowSource();
+
+  bool next(Row &row) override;
+  void cancel() override;
+
+private:
+  std::shared_ptr<PrefetchScan> _scan;
+};
+
+/*
+ * Serves copies of rows that are kept for other cursors too.
+ */
+class SharedRowSource : public RowSource {
+public:
+  SharedRowSource(std::shared_ptr<const std::vector<Row> > rows) : _rows(rows) {}
+
+  bool next(Row &row) override;
+  void cancel() override {}
+
+private:
+  std::shared_ptr<const std::vector<Row> > _rows;
+  size_t _rowIdx {0};
+};
+
+/*
+ * Passes on rows from another source, or from the table's nextRow()
+ * when there is none, keeping a copy of each (table_attrs
+ * "CACHEABLE").  Once the rows run out, the copies are handed to
+ * done(), so later scans with the same constraints can be served
+ * by a SharedRowSource.  A cancelled scan is not handed on.
+ */
+class RecordingRowSource : public RowSource {
+public:
+  typedef std::function<void(std::shared_ptr<const std::vector<Row> >)> DoneFunc;
+
+  RecordingRowSource(VirtualTable *table, SPQueryContext context, std::unique_ptr<RowSource> inner, DoneFunc done)
+      : _table(table), _context(context), _inner(std::move(inner)), _done(done) {}
+
+  bool next(Row &row) override;
+  void cancel() override;
+
+private:
+  VirtualTable *_table;
+  SPQueryContext _context;
+  std::unique_ptr<RowSource> _inner;  // null to call _table directly
+  DoneFunc _done;
+  std::vector<Row> _rows;
+  bool _finished {false};
+};
+
+} // namespace vsqlite
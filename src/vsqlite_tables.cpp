@@ -1,7 +1,11 @@
 
 #include "vsqlite_impl.h"
+#include "vsqlite_rowsource.h"
 #include <assert.h>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
 
 #define TRACE if (VT_TRACE)
 
@@ -20,8 +24,35 @@ namespace vsqlite {
     int colIdx;
     int termIdx;
     unsigned char op;
+    bool inList;    // argv value is a whole IN (...) list
+    bool binary;    // sqlite compares with the BINARY collation
   };
 
+  /*
+   * Planning decision for one xBestIndex constraint shape.
+   * Built once per shape and shared, read-only, by every
+   * context that uses it.
+   */
+  struct QueryPlan {
+    struct term_usage_t {
+      int argvIndex;
+      bool omit;
+      bool inList;
+    };
+    std::vector<term_usage_t> usage;                  // per aConstraint term
+    std::vector<constraint_info_t> constraint_infos;  // in argv order
+    std::set<SPFieldDef> colsUsed;
+    ColumnBitmap colsUsedBits;
+    int orderingIdx {-1};  // TableDef.orderings consumed, if any
+    int indexIdx {-1};     // TableDef.indexes matched, if any
+    IndexEstimate est {0, 0, false};
+    bool missingRequired {false};
+    int fanoutArg {-1};    // argv IN list split into parallel lookups
+    int autoIndexCol {-1}; // column looked up in a transient index
+    int id {0};            // idxNum passed to xFilter
+  };
+  typedef std::shared_ptr<const QueryPlan> SPQueryPlan;
+
   /*
    * Basis of the QueryContext provided
    * to table prepare() methods.
@@ -31,8 +62,53 @@ namespace vsqlite {
     std::vector<Constraint> getConstraints() override {
       return _constraints;
     }
+    ConstraintSpan getConstraintSpan() override {
+      return ConstraintSpan(_constraints.data(), _constraints.size());
+    }
+    const Constraint *findConstraint(const SPFieldDef &columnId, ConstraintOp op) override {
+      for (auto &c : _constraints) {
+        if (c.columnId == columnId && c.op == op) {
+          return &c;
+        }
+      }
+      return nullptr;
+    }
     std::set<SPFieldDef> getRequestedColumns() override {
-      return _colsUsed;
+      return _plan->colsUsed;
+    }
+    const ColumnBitmap &getRequestedColumnBits() override {
+      return _plan->colsUsedBits;
+    }
+    bool isCountOnly() override {
+      return _plan->colsUsedBits.empty();
+    }
+    bool isRowNeeded() override {
+      return _rowNeeded;
+    }
+    bool isColumnRequested(const SPFieldDef &columnId) override {
+      auto it = _requestIndex->find(columnId.get());
+      return it != _requestIndex->end() && _plan->colsUsedBits.test(it->second);
+    }
+    bool getRange(const SPFieldDef &columnId, ColumnRange &range) override {
+      for (auto &r : _ranges) {
+        if (r.columnId == columnId) {
+          range = r;
+          return true;
+        }
+      }
+      return false;
+    }
+    int getOrderingIndex() override {
+      return _plan->orderingIdx;
+    }
+    int getIndexIndex() override {
+      return _plan->indexIdx;
+    }
+    int64_t getRowLimitHint() override {
+      return _rowLimit;
+    }
+    int getPartition() override {
+      return _partition;
     }
 
     /*
@@ -46,53 +122,207 @@ namespace vsqlite {
       return _userData;
     }
 
-    int _idxNum {0};    // matches value set in xBestIndex
-    std::vector<constraint_info_t> _constraint_infos;
-    std::set<SPFieldDef> _colsUsed;
+    // next state<T>() call resets the table's state
+    void markStateStale() {
+      _stateStale = true;
+    }
+
+    // release what the table's state holds, keeping the object
+    void resetState() {
+      if (_state && _stateReset) {
+        _stateReset(_state.get());
+      }
+      _stateStale = false;
+    }
+
+    SPQueryPlan _plan;
+    const std::unordered_map<const FieldDef*, int> *_requestIndex {nullptr}; // owned by my_vtab
+    int64_t _rowLimit {-1}; // LIMIT + OFFSET, set in xFilter
+    int _partition {-1};
+    bool _rowNeeded {true};  // false if xColumn reads rows via writeColumn()
 
     std::vector<Constraint> _constraints;
+    std::vector<ColumnRange> _ranges;
+    std::vector<SPFieldDef> _unranged;  // columns with constraints addToRange() can't merge
     std::shared_ptr<void> _userData;
   };
 
-  static int kConstraintIndexID = 1; // increments with each index used
-  static int gQueryStartIndex = 1;
-  
-  static std::string _TINDENT(int idxNum) {
-    std::string s = "";
-    for (int i=1 ; i < idxNum - gQueryStartIndex;i++) { s += "   "; }
-    return s;
-  }
+/*
+ * Rows of a BATCH_LOOKUP table for the next join keys of the outer
+ * scans, fetched with one lookupBatch() call.  Loaded at a cursor's
+ * first lookup, and again when a lookup is past the last batch.
+ */
+struct BatchLookup {
+  SPQueryPlan plan;        // lookups answered
+  bool declined {false};   // lookupBatch() returned false
 
-  static std::string _TINDENT(std::shared_ptr<QueryContextImpl> spContext) {
-    if (spContext == nullptr || spContext->_idxNum <= 0)
-      return "";
-    return _TINDENT(spContext->_idxNum);
-  }
+  // by valueKey(), keys lookupBatch() did not know have no rows
+  std::unordered_map<std::string, std::shared_ptr<const std::vector<Row> > > rows;
+};
+
+/*
+ * All rows of an AUTO_INDEX table, hashed by one column.  Built by
+ * the second xFilter of a plan and kept with the running statement,
+ * so the rest of its lookups are served from memory.
+ */
+struct TransientIndex {
+  bool built {false};  // rows are hashed, see serveFromTransientIndex()
+  bool usable {true};  // false if a row value is not of the column's type
+  std::unordered_map<std::string, std::shared_ptr<const std::vector<Row> > > rows;  // by valueKey()
+};
+
+static bool hasTableAttr(const TableDef &td, const std::string &attr) {
+  return std::find(td.table_attrs.begin(), td.table_attrs.end(), attr) != td.table_attrs.end();
+}
+
+/*
+ * sqlite3_create_module() client data, one per added table
+ */
+struct module_aux_t {
+  VirtualTable *implementation;
+  VSQLiteImpl *owner;
+};
 
 /*
  * state needed to track virtual table state.
  */
 struct my_vtab : public sqlite3_vtab {
-  my_vtab(VirtualTable *implementation) : sqlite3_vtab(), _implementation(implementation), _contexts() {} //_colsUsed(), _constraints() {}
+  my_vtab(const module_aux_t &aux) : sqlite3_vtab(), _implementation(aux.implementation), _owner(aux.owner) {
+    VirtualTable *implementation = _implementation;
+    const TableDef &td = implementation->getTableDef();
+    for (int i=0; i < (int)td.columns.size(); i++) {
+      if (!td.columns[i].aliased) {
+        _columnIndex[td.columns[i].id.get()] = i;
+      }
+    }
+    _requestIndex = _columnIndex;
+    for (auto &coldef : td.columns) {
+      auto it = (coldef.aliased ? _columnIndex.find(coldef.aliased.get()) : _columnIndex.end());
+      if (it != _columnIndex.end()) {
+        _requestIndex[coldef.id.get()] = it->second;
+      }
+    }
+    _pipelined = hasTableAttr(td, "PIPELINE");
+    _parallelLookup = hasTableAttr(td, "PARALLEL_LOOKUP");
+    _partitionsOrdered = hasTableAttr(td, "PARTITIONED_ORDERED");
+    _partitioned = _partitionsOrdered || hasTableAttr(td, "PARTITIONED");
+    _prefetchable = hasTableAttr(td, "PREFETCH");
+    _batchLookup = hasTableAttr(td, "BATCH_LOOKUP");
+    _autoIndex = hasTableAttr(td, "AUTO_INDEX");
+    _cacheable = hasTableAttr(td, "CACHEABLE");
+  }
   VirtualTable *_implementation;
-
-  // following provided in xBestIndex
-  //std::set<SPFieldDef> _colsUsed;
-  //std::vector<constraint_info_t> _constraints;
-  std::vector<std::shared_ptr<QueryContextImpl> > _contexts;
+  VSQLiteImpl *_owner;
+  bool _pipelined {false};          // table_attrs PIPELINE
+  bool _parallelLookup {false};     // table_attrs PARALLEL_LOOKUP
+  bool _partitioned {false};        // table_attrs PARTITIONED or PARTITIONED_ORDERED
+  bool _partitionsOrdered {false};  // partitions are served in order
+  bool _prefetchable {false};       // table_attrs PREFETCH
+  bool _batchLookup {false};        // table_attrs BATCH_LOOKUP
+  bool _autoIndex {false};          // table_attrs AUTO_INDEX
+  bool _cacheable {false};          // table_attrs CACHEABLE
+
+  // position of each non-alias column in TableDef.columns
+  std::unordered_map<const FieldDef*, int> _columnIndex;
+
+  // as _columnIndex, plus each alias at its aliased column's position
+  std::unordered_map<const FieldDef*, int> _requestIndex;
+
+  // contexts of closed cursors, reused by the next xFilter
+  std::vector<std::shared_ptr<QueryContextImpl> > _contextPool;
+
+  // Plans built in xBestIndex, keyed by constraint shape (see
+  // planSignature()).  The least recently used are dropped beyond
+  // MAX_CACHED_PLANS.  xFilter finds a plan by the id passed as
+  // idxNum for as long as a running statement or context holds it.
+  struct cached_plan_t {
+    SPQueryPlan plan;
+    uint64_t lastUsed;
+  };
+  std::map<std::vector<int64_t>, cached_plan_t> _plans;
+  std::unordered_map<int, std::weak_ptr<const QueryPlan> > _plansById;
+  uint64_t _planClock {0};
+  int _nextPlanId {1};
   uint64_t _rowId {0};
 };
 
+//----------------------------------------------------------------------
+// forget ids of plans no longer held by a statement or context
+//----------------------------------------------------------------------
+static void dropExpiredPlanIds(my_vtab *pVT) {
+  for (auto it = pVT->_plansById.begin(); it != pVT->_plansById.end(); ) {
+    if (it->second.expired()) {
+      it = pVT->_plansById.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+/*
+ * State of the tables for one statement run by VSQLiteImpl::query(),
+ * innermost last in VSQLiteImpl::_statements.
+ */
+struct my_vtab_cursor;
+
+struct RunningStatement {
+  RunningStatement(std::vector<RunningStatement*> &running) : _running(running) {
+    _running.push_back(this);
+  }
+  ~RunningStatement() {
+    _running.pop_back();
+    std::vector<my_vtab*> tables;
+    for (auto &item : _plans) {
+      tables.push_back(item.first);
+    }
+    _plans.clear();
+    for (auto pVT : tables) {
+      dropExpiredPlanIds(pVT);
+    }
+  }
+
+  // plans handed to sqlite by xBestIndex while preparing
+  void addPlan(my_vtab *pVT, SPQueryPlan spPlan) {
+    std::vector<SPQueryPlan> &plans = _plans[pVT];
+    if (std::find(plans.begin(), plans.end(), spPlan) == plans.end()) {
+      plans.push_back(spPlan);
+    }
+  }
+
+  std::vector<RunningStatement*> &_running;
+  std::map<my_vtab*, std::vector<SPQueryPlan> > _plans;
+  std::vector<my_vtab_cursor*> _cursors;  // open cursors, see xOpen
+  bool _filtered {false};                 // xFilter called on any cursor
+
+  // AUTO_INDEX rows by table and plan id
+  std::map<std::pair<my_vtab*, int>, std::shared_ptr<TransientIndex> > _transientIndexes;
+
+  // CACHEABLE rows by table and scanKey()
+  std::map<std::pair<my_vtab*, std::string>, std::shared_ptr<const std::vector<Row> > > _snapshots;
+};
+
 /*
  * Cursors are opened after xBestIndex
  */
 struct my_vtab_cursor : public sqlite3_vtab_cursor {
-  my_vtab_cursor(my_vtab *pvt) : sqlite3_vtab_cursor(), _pvt(pvt) {}
+  my_vtab_cursor(my_vtab *pvt) : sqlite3_vtab_cursor(), _pvt(pvt),
+      _row(&pvt->_columnIndex, pvt->_implementation->getTableDef().columns.size()) {}
 
   // member variables
   my_vtab *_pvt;
-  DynMap   _row;
+  Row      _row;
+  bool     _eof {true};
   std::shared_ptr<QueryContextImpl> _context;
+  std::unique_ptr<PipelineWorker> _pipeline;  // PIPELINE thread, kept across xFilter calls
+  std::unique_ptr<RowSource> _source;  // rows not from _pvt->_implementation directly
+  RunningStatement *_statement {nullptr};
+
+  // scan started for the cursor's first xFilter, see startPrefetch()
+  std::shared_ptr<PrefetchScan> _prefetch;
+  SPQueryPlan _prefetchPlan;
+  std::shared_ptr<PrefetchScan> _scan;  // prefetched scan being read
+
+  std::unique_ptr<BatchLookup> _batch;  // BATCH_LOOKUP join rows
 };
 
 
@@ -106,7 +336,7 @@ static int xConnect(sqlite3* db,
             sqlite3_vtab** ppVtab,
             char** pzErr) {
 
-  my_vtab *pvt = new my_vtab((VirtualTable*)pAux);
+  my_vtab *pvt = new my_vtab(*(module_aux_t*)pAux);
   *ppVtab = pvt;
 
   const TableDef &tableDef = pvt->_implementation->getTableDef();
@@ -118,228 +348,1410 @@ static int xConnect(sqlite3* db,
            sql.c_str());
     return rc;
   }
-  return SQLITE_OK;
+  return SQLITE_OK;
+}
+
+//----------------------------------------------------------------------
+// open cursor
+//----------------------------------------------------------------------
+static int xOpen(sqlite3_vtab* tab, sqlite3_vtab_cursor** ppCursor) {
+  auto pCur = new my_vtab_cursor((my_vtab*)tab);
+  pCur->_statement = pCur->_pvt->_owner->currentStatement();
+  if (pCur->_statement != nullptr) {
+    pCur->_statement->_cursors.push_back(pCur);
+  }
+  *ppCursor = pCur;
+  return SQLITE_OK;
+}
+
+//----------------------------------------------------------------------
+// get index of fieldId in columns
+//----------------------------------------------------------------------
+static int getIndexOfColumn(SPFieldDef fieldId, const TableDef &tableDef) {
+  for (int i=0; i < tableDef.columns.size();i++) {
+    if (tableDef.columns[i].id == fieldId) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+//----------------------------------------------------------------------
+// true if columnId is part of TableDef.indexes[indexIdx]
+//----------------------------------------------------------------------
+static bool isInIndex(const TableDef &tableDef, int indexIdx, SPFieldDef columnId) {
+  if (indexIdx < 0 || indexIdx >= (int)tableDef.indexes.size()) {
+    return false;
+  }
+  for (auto &id : tableDef.indexes[indexIdx].columns) {
+    if (id == columnId) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------
+// op
+//----------------------------------------------------------------------
+static inline std::string opString(unsigned char op) {
+  switch (op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+      return "=";
+    case SQLITE_INDEX_CONSTRAINT_GT:
+      return ">";
+    case SQLITE_INDEX_CONSTRAINT_LE:
+      return "<=";
+    case SQLITE_INDEX_CONSTRAINT_LT:
+      return "<";
+    case SQLITE_INDEX_CONSTRAINT_GE:
+      return ">=";
+    case SQLITE_INDEX_CONSTRAINT_LIKE:
+      return "LIKE";
+    case SQLITE_INDEX_CONSTRAINT_MATCH:
+      return "MATCH";
+    case SQLITE_INDEX_CONSTRAINT_GLOB:
+      return "GLOB";
+    case SQLITE_INDEX_CONSTRAINT_REGEXP:
+      return "REGEX";
+    case SQLITE_INDEX_CONSTRAINT_NE:
+      return "!=";
+    case SQLITE_INDEX_CONSTRAINT_ISNOT:
+      return "IS NOT";
+    case SQLITE_INDEX_CONSTRAINT_ISNOTNULL:
+      return "IS NOT NULL";
+    case SQLITE_INDEX_CONSTRAINT_ISNULL:
+      return "IS NULL";
+    case SQLITE_INDEX_CONSTRAINT_IS:
+      return "IS";
+    case OP_LIMIT:
+      return "LIMIT";
+    case OP_OFFSET:
+      return "OFFSET";
+    default:
+      break;
+  }
+  return "?";
+}
+
+//----------------------------------------------------------------------
+// returns index of first TableDef.orderings entry that satisfies
+// the ORDER BY terms in pIdxInfo, or -1.
+//----------------------------------------------------------------------
+static int findOrdering(const TableDef &td, sqlite3_index_info* pIdxInfo) {
+  if (pIdxInfo->nOrderBy <= 0) {
+    return -1;
+  }
+  for (int j=0; j < (int)td.orderings.size(); j++) {
+    const Ordering &ordering = td.orderings[j];
+    if (ordering.size() < (size_t)pIdxInfo->nOrderBy) { continue; }
+
+    bool matches = true;
+    for (int k=0; k < pIdxInfo->nOrderBy && matches; k++) {
+      const sqlite3_index_info::sqlite3_index_orderby &term = pIdxInfo->aOrderBy[k];
+      if (term.iColumn < 0 || term.iColumn >= (int)td.columns.size()) {
+        return -1; // rowid
+      }
+      SPFieldDef columnId = td.columns[term.iColumn].id;
+      if (td.columns[term.iColumn].aliased) {
+        columnId = td.columns[term.iColumn].aliased;
+      }
+      matches = (ordering[k].columnId == columnId && ordering[k].desc == (term.desc != 0));
+    }
+    if (matches) {
+      return j;
+    }
+  }
+  return -1;
+}
+
+//----------------------------------------------------------------------
+// LIMIT and OFFSET are passed as constraints by sqlite 3.38 and later
+//----------------------------------------------------------------------
+static inline bool isLimitOp(unsigned char op) {
+  return (op == OP_LIMIT || op == OP_OFFSET);
+}
+
+/*
+ * usable constraint the table could accept, found in xBestIndex
+ */
+struct candidate_t {
+  int term;                   // index into aConstraint
+  const ColumnDef *pcoldef;   // alias resolved
+};
+
+//----------------------------------------------------------------------
+// true if columnId is part of any TableDef.indexes entry
+//----------------------------------------------------------------------
+static bool isInCompositeIndex(const TableDef &td, SPFieldDef columnId) {
+  for (int j=0; j < (int)td.indexes.size(); j++) {
+    if (isInIndex(td, j, columnId)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------
+// Returns the TableDef.indexes entry with the most columns that is
+// fully constrained by candidates, or -1.  All columns but the last
+// need an OP_EQ constraint.
+//----------------------------------------------------------------------
+static int findCompositeIndex(const TableDef &td, sqlite3_index_info* pIdxInfo, const std::vector<candidate_t> &candidates) {
+  int best = -1;
+  for (int j=0; j < (int)td.indexes.size(); j++) {
+    const IndexDef &indexDef = td.indexes[j];
+    if (indexDef.columns.empty()) { continue; }
+    if (best >= 0 && td.indexes[best].columns.size() >= indexDef.columns.size()) { continue; }
+
+    bool matches = true;
+    for (size_t k=0; k < indexDef.columns.size() && matches; k++) {
+      bool isLast = (k + 1 == indexDef.columns.size());
+      matches = false;
+      for (auto &cand : candidates) {
+        if (cand.pcoldef->id == indexDef.columns[k] &&
+            (isLast || pIdxInfo->aConstraint[cand.term].op == SQLITE_INDEX_CONSTRAINT_EQ)) {
+          matches = true;
+          break;
+        }
+      }
+    }
+    if (matches) {
+      best = j;
+    }
+  }
+  return best;
+}
+
+// cost used when a table accepts constraints without declaring any estimates
+#define DEFAULT_INDEXED_COST 10000
+
+// values assumed in an IN list passed whole to xFilter, whose
+// length is not known while planning
+#define IN_LIST_ROWS_FACTOR 10
+
+//----------------------------------------------------------------------
+// Build planner estimates from TableDef and ColumnDef hints.
+// Lookups with unknown selectivity are assumed to return a tenth
+// of the table.  If nothing is declared, constrained plans keep
+// the historical fixed cost and full scans keep sqlite's default.
+//----------------------------------------------------------------------
+static IndexEstimate defaultEstimate(const TableDef &td, const std::vector<IndexConstraint> &constraints, int indexIdx) {
+  IndexEstimate est = { 0, 0, false };
+
+  if (constraints.empty()) {
+    if (td.estimatedRows > 0) {
+      est.rows = td.estimatedRows;
+      est.cost = (double)td.estimatedRows;
+    }
+    return est;
+  }
+
+  for (auto &ic : constraints) {
+    int colIdx = getIndexOfColumn(ic.columnId, td);
+    if (colIdx < 0) { continue; }
+    const ColumnDef &coldef = td.columns[colIdx];
+
+    int64_t rows = 0;
+    if (ic.op == OP_EQ && (coldef.options & UNIQUE)) {
+      rows = 1;
+      est.unique = true;
+    } else if (coldef.estimatedRows > 0) {
+      rows = coldef.estimatedRows;
+    }
+    if (rows > 0 && (est.rows == 0 || rows < est.rows)) {
+      est.rows = rows;
+    }
+  }
+
+  if (indexIdx >= 0) {
+    const IndexDef &indexDef = td.indexes[indexIdx];
+    int64_t rows = indexDef.estimatedRows;
+
+    // the last column may only be bounded by a range
+    bool allEq = true;
+    for (auto &columnId : indexDef.columns) {
+      bool hasEq = false;
+      for (auto &ic : constraints) {
+        hasEq = hasEq || (ic.columnId == columnId && ic.op == OP_EQ);
+      }
+      allEq = allEq && hasEq;
+    }
+    if ((indexDef.options & UNIQUE) && allEq) {
+      rows = 1;
+      est.unique = true;
+    }
+    if (rows > 0 && (est.rows == 0 || rows < est.rows)) {
+      est.rows = rows;
+    }
+  }
+
+  if (est.rows == 0 && td.estimatedRows > 0) {
+    est.rows = std::max<int64_t>(1, td.estimatedRows / 10);
+  }
+
+  est.cost = (est.rows > 0 ? (double)est.rows : DEFAULT_INDEXED_COST);
+
+  return est;
+}
+
+//----------------------------------------------------------------------
+// sqlite 3.38 added IN list and right-hand side access to xBestIndex.
+// Built against older sqlite, IN list values arrive one xFilter at a
+// time and no right-hand side is known while planning.
+//----------------------------------------------------------------------
+#if SQLITE_VERSION_NUMBER >= 3038000
+#define VSQLITE_HAS_VTAB_IN 1
+#else
+#define VSQLITE_HAS_VTAB_IN 0
+#endif
+
+//----------------------------------------------------------------------
+// true if constraint i is an IN (...) list sqlite can pass whole
+//----------------------------------------------------------------------
+static bool isInListTerm(sqlite3_index_info* pIdxInfo, int i) {
+#if VSQLITE_HAS_VTAB_IN
+  return sqlite3_vtab_in(pIdxInfo, i, -1) != 0;
+#else
+  return false;
+#endif
+}
+
+//----------------------------------------------------------------------
+// ask sqlite to pass the IN (...) list of constraint i whole
+//----------------------------------------------------------------------
+static void takeInList(sqlite3_index_info* pIdxInfo, int i) {
+#if VSQLITE_HAS_VTAB_IN
+  sqlite3_vtab_in(pIdxInfo, i, 1);
+#endif
+}
+
+//----------------------------------------------------------------------
+// true if the right-hand side of constraint i is known while
+// planning, e.g. a literal rather than a column of another table
+//----------------------------------------------------------------------
+static bool isConstantRhs(sqlite3_index_info* pIdxInfo, int i) {
+#if VSQLITE_HAS_VTAB_IN
+  sqlite3_value *rhs = nullptr;
+  return sqlite3_vtab_rhs_value(pIdxInfo, i, &rhs) == SQLITE_OK;
+#else
+  return false;
+#endif
+}
+
+//----------------------------------------------------------------------
+// true if sqlite compares constraint i with the BINARY collation
+//----------------------------------------------------------------------
+static bool isBinaryCollation(sqlite3_index_info* pIdxInfo, int i) {
+  const char *collation = sqlite3_vtab_collation(pIdxInfo, i);
+  return (nullptr == collation || sqlite3_stricmp(collation, "BINARY") == 0);
+}
+
+//----------------------------------------------------------------------
+// Key for the plan cache.  sqlite calls xBestIndex many times while
+// planning joins, usually with the same few shapes.  Everything
+// buildPlan() reads from pIdxInfo must be part of the key.
+//----------------------------------------------------------------------
+static std::vector<int64_t> planSignature(sqlite3_index_info* pIdxInfo) {
+  std::vector<int64_t> key;
+  key.reserve(2 + pIdxInfo->nConstraint * 6 + pIdxInfo->nOrderBy * 2 + 1);
+
+  key.push_back(pIdxInfo->nConstraint);
+  for (int i=0; i < pIdxInfo->nConstraint; i++) {
+    const sqlite3_index_info::sqlite3_index_constraint &constraint_info = pIdxInfo->aConstraint[i];
+    key.push_back(constraint_info.iColumn);
+    key.push_back(constraint_info.op);
+    key.push_back(constraint_info.usable);
+    key.push_back(constraint_info.usable && constraint_info.op == SQLITE_INDEX_CONSTRAINT_EQ &&
+                  isInListTerm(pIdxInfo, i));
+    key.push_back(constraint_info.usable && constraint_info.op == SQLITE_INDEX_CONSTRAINT_EQ &&
+                  isConstantRhs(pIdxInfo, i));
+    key.push_back(constraint_info.usable && isBinaryCollation(pIdxInfo, i));
+  }
+
+  key.push_back(pIdxInfo->nOrderBy);
+  for (int k=0; k < pIdxInfo->nOrderBy; k++) {
+    key.push_back(pIdxInfo->aOrderBy[k].iColumn);
+    key.push_back(pIdxInfo->aOrderBy[k].desc);
+  }
+
+  key.push_back((int64_t)pIdxInfo->colUsed);
+  return key;
+}
+
+//----------------------------------------------------------------------
+// Decide which constraints the table will handle and what the plan
+// costs.  Does not modify pIdxInfo, see applyPlan().
+//----------------------------------------------------------------------
+static SPQueryPlan buildPlan(my_vtab* pVT, sqlite3_index_info* pIdxInfo) {
+  int numRequiredConstraints = 0;
+  int numIndexedConstraints = 0;
+  int numRequiredColumns = 0;
+  int numIndexedColumns = 0;
+  int xFilterArgvIndex = 0;
+  auto spPlan = std::make_shared<QueryPlan>();
+  spPlan->id = pVT->_nextPlanId++;
+  spPlan->usage.resize(pIdxInfo->nConstraint, {0, false, false});
+
+  const TableDef & td = pVT->_implementation->getTableDef();
+
+  // gather constraints
+
+  int limitTerm = -1, offsetTerm = -1;
+  int fanoutTerm = -1;
+  int numInLists = 0;
+  bool offsetUsable = true;
+  int numTerms = 0, numOmitted = 0;
+  std::vector<candidate_t> candidates;
+
+  if (pIdxInfo->nConstraint > 0) {
+    for (size_t i = 0; i < static_cast<size_t>(pIdxInfo->nConstraint); ++i) {
+      const sqlite3_index_info::sqlite3_index_constraint &constraint_info = pIdxInfo->aConstraint[i];
+
+      if (isLimitOp(constraint_info.op)) {
+        if (constraint_info.op == OP_LIMIT) {
+          limitTerm = (constraint_info.usable ? (int)i : -1);
+        } else {
+          offsetTerm = (int)i;
+          offsetUsable = (constraint_info.usable != 0);
+        }
+        continue;
+      }
+
+      numTerms++;
+
+      if (constraint_info.iColumn >= td.columns.size()) {
+        continue;
+      }
+      if (constraint_info.usable == 0) { continue; }
+
+      // get column def, dealing with aliases
+
+      const ColumnDef *pcoldef = &td.columns[constraint_info.iColumn];
+      if (pcoldef->aliased) {
+        int j = getIndexOfColumn(pcoldef->aliased, td);
+        if (j < 0) {
+          // TODO: error
+          continue;
+        }
+        pcoldef = &td.columns[j];
+      }
+
+      TRACE fprintf(stderr, "   icol:%d (%s) op:%s termOffset:%d\n", constraint_info.iColumn, pcoldef->id->name.c_str(), opString(constraint_info.op).c_str(), constraint_info.iTermOffset );
+
+      if ((pcoldef->options & (INDEXED | REQUIRED | ADDITIONAL)) == 0 &&
+          !isInCompositeIndex(td, pcoldef->id)) {
+        TRACE fprintf(stderr, "   No such index implemented\n");
+        continue;
+      }
+
+      // does vtable support the constraint?
+
+      if (pcoldef->indexOpsImplemented.empty()) {
+        if (constraint_info.op != SQLITE_INDEX_CONSTRAINT_EQ) {
+          continue;
+        }
+      } else {
+        if (pcoldef->indexOpsImplemented.find((ConstraintOp)constraint_info.op) == pcoldef->indexOpsImplemented.end()) {
+          continue;
+        }
+      }
+
+      candidates.push_back({(int)i, pcoldef});
+    }
+  }
+
+  // columns only indexed as part of a composite index are only
+  // useful if the whole index is constrained
+
+  spPlan->indexIdx = findCompositeIndex(td, pIdxInfo, candidates);
+  if (spPlan->indexIdx >= 0) {
+    TRACE fprintf(stderr, "   composite index:%d\n", spPlan->indexIdx);
+  }
+
+  for (auto &cand : candidates) {
+    size_t i = (size_t)cand.term;
+    const sqlite3_index_info::sqlite3_index_constraint &constraint_info = pIdxInfo->aConstraint[i];
+    const ColumnDef *pcoldef = cand.pcoldef;
+
+    if ((pcoldef->options & (INDEXED | REQUIRED | ADDITIONAL)) == 0 &&
+        !isInIndex(td, spPlan->indexIdx, pcoldef->id)) {
+      continue;
+    }
+
+    // mark use
+
+    if (pcoldef->options & REQUIRED) {
+      numRequiredConstraints ++;
+    }
+    else {
+        if (pcoldef->options & (INDEXED | ADDITIONAL)) {
+          numIndexedConstraints ++;
+        }
+    }
+
+    // save constraint
+
+    QueryPlan::term_usage_t &usage = spPlan->usage[i];
+    usage.argvIndex = ++xFilterArgvIndex;
+
+    // table promises rows match exactly, no need for sqlite to check again
+
+    if (pcoldef->exactOps.count((ConstraintOp)constraint_info.op)) {
+      usage.omit = true;
+      numOmitted++;
+    }
+
+    // ask sqlite to pass all IN (...) values to a single xFilter
+
+    if ((pcoldef->options & BATCH_IN) && constraint_info.op == SQLITE_INDEX_CONSTRAINT_EQ &&
+        isInListTerm(pIdxInfo, (int)i)) {
+      usage.inList = true;
+      numInLists++;
+    }
+
+    // PARALLEL_LOOKUP tables get one IN list whole, to split it up
+
+    if (pVT->_parallelLookup && fanoutTerm < 0 && !usage.inList &&
+        constraint_info.op == SQLITE_INDEX_CONSTRAINT_EQ && isInListTerm(pIdxInfo, (int)i)) {
+      fanoutTerm = (int)i;
+      spPlan->fanoutArg = usage.argvIndex - 1;
+    }
+
+    spPlan->constraint_infos.push_back({pcoldef->id, constraint_info.iColumn, constraint_info.iTermOffset, constraint_info.op, usage.inList,
+                                       isBinaryCollation(pIdxInfo, (int)i)});
+  }
+
+  // AUTO_INDEX tables can look up any column in a transient index,
+  // worthwhile when the value changes between xFilter calls, as in
+  // the inner loop of a join.  sqlite checks the value again.
+
+  if (pVT->_autoIndex && spPlan->constraint_infos.empty()) {
+    for (int i=0; i < pIdxInfo->nConstraint; i++) {
+      const sqlite3_index_info::sqlite3_index_constraint &constraint_info = pIdxInfo->aConstraint[i];
+      if (!constraint_info.usable || constraint_info.op != SQLITE_INDEX_CONSTRAINT_EQ ||
+          constraint_info.iColumn < 0 || constraint_info.iColumn >= (int)td.columns.size() ||
+          isConstantRhs(pIdxInfo, i) || !isBinaryCollation(pIdxInfo, i)) {
+        continue;
+      }
+      int colIdx = constraint_info.iColumn;
+      if (td.columns[colIdx].aliased) {
+        colIdx = getIndexOfColumn(td.columns[colIdx].aliased, td);
+        if (colIdx < 0) { continue; }
+      }
+      TRACE fprintf(stderr, "   transient index on %s\n", td.columns[colIdx].id->name.c_str());
+      spPlan->autoIndexCol = colIdx;
+      spPlan->usage[i].argvIndex = ++xFilterArgvIndex;
+      spPlan->constraint_infos.push_back({td.columns[colIdx].id, constraint_info.iColumn, constraint_info.iTermOffset, constraint_info.op, false, true});
+      break;
+    }
+  }
+
+  // track columns requested, so vtables can optimize out work if needed
+
+  spPlan->colsUsedBits = ColumnBitmap(td.columns.size());
+
+  for (int i=0; i < td.columns.size(); i++) {
+    const ColumnDef *pcoldef = &td.columns[i];
+    int actualColIdx = i;
+
+    // handle column aliases
+
+    if (pcoldef->aliased) {
+      actualColIdx = getIndexOfColumn(pcoldef->aliased, td);
+      if (actualColIdx < 0) {
+        // TODO: log error
+        continue;
+      }
+      pcoldef = &td.columns[actualColIdx];
+    } else {
+
+      // only count these for non-aliased columns
+
+      if (pcoldef->options & (INDEXED | ADDITIONAL)) {
+        numIndexedColumns++;
+      }
+      if (pcoldef->options & (REQUIRED)) {
+        numRequiredColumns++;
+      }
+    }
+
+    // track columns used.  bit 63 covers column 63 and above.
+
+    if (pIdxInfo->colUsed & (1ULL << std::min(i, 63))) {
+      spPlan->colsUsed.insert(pcoldef->id);
+      spPlan->colsUsedBits.set(actualColIdx);
+    }
+  }
+
+  if (numRequiredConstraints < numRequiredColumns) {
+    TRACE fprintf(stderr, "Required constraint missing\n");
+    spPlan->missingRequired = true;
+    return spPlan;
+  }
+
+  // can the table return rows in ORDER BY order?
+  // not if partitions are interleaved.
+
+  if (!pVT->_partitioned || pVT->_partitionsOrdered) {
+    spPlan->orderingIdx = findOrdering(td, pIdxInfo);
+  }
+  if (spPlan->orderingIdx >= 0) {
+    TRACE fprintf(stderr, "   orderByConsumed ordering:%d\n", spPlan->orderingIdx);
+  }
+
+  // Lookups are served in IN list order, which need not be the
+  // ORDER BY order.  Leave those to sqlite.
+
+  if (fanoutTerm >= 0 && spPlan->orderingIdx < 0) {
+    TRACE fprintf(stderr, "   parallel lookups on argv[%d]\n", spPlan->fanoutArg);
+    spPlan->usage[fanoutTerm].inList = true;
+    spPlan->constraint_infos[spPlan->fanoutArg].inList = true;
+    numInLists++;
+  } else {
+    spPlan->fanoutArg = -1;
+  }
+
+  // LIMIT/OFFSET can be passed on as a hint only if the table handles
+  // every other constraint exactly and returns rows in ORDER BY order.
+  // Otherwise sqlite may still discard or reorder rows after the table
+  // has stopped producing them.
+
+  if (limitTerm >= 0 && numOmitted == numTerms && offsetUsable &&
+      (pIdxInfo->nOrderBy == 0 || spPlan->orderingIdx >= 0)) {
+    for (int term : { limitTerm, offsetTerm }) {
+      if (term < 0) { continue; }
+      const sqlite3_index_info::sqlite3_index_constraint &constraint_info = pIdxInfo->aConstraint[term];
+      TRACE fprintf(stderr, "   %s hint\n", opString(constraint_info.op).c_str());
+      spPlan->usage[term].argvIndex = ++xFilterArgvIndex;
+      spPlan->constraint_infos.push_back({nullptr, constraint_info.iColumn, constraint_info.iTermOffset, constraint_info.op, false, true});
+    }
+  }
+
+  // let sqlite know how expensive this plan is.
+  // estimate() results are cached along with the plan.
+
+  std::vector<IndexConstraint> indexConstraints;
+  for (auto &cinfo : spPlan->constraint_infos) {
+    if (isLimitOp(cinfo.op)) { continue; }
+    indexConstraints.push_back({cinfo.columnId, (ConstraintOp)cinfo.op});
+  }
+
+  spPlan->est = defaultEstimate(td, indexConstraints, spPlan->indexIdx);
+  pVT->_implementation->estimate(indexConstraints, spPlan->est);
+
+  // one xFilter returns the rows of every IN list value.  sqlite
+  // does not drop SQLITE_INDEX_SCAN_UNIQUE for lists the table
+  // handles, so don't claim it.
+
+  if (numInLists > 0) {
+    spPlan->est.unique = false;
+    for (int k=0; k < numInLists && spPlan->est.rows > 0; k++) {
+      spPlan->est.rows *= IN_LIST_ROWS_FACTOR;
+    }
+    if (td.estimatedRows > 0 && spPlan->est.rows > td.estimatedRows) {
+      spPlan->est.rows = td.estimatedRows;
+    }
+  }
+
+  TRACE fprintf(stderr, "   estimate cost:%g rows:%lld unique:%d\n", spPlan->est.cost, (long long)spPlan->est.rows, spPlan->est.unique);
+
+  return spPlan;
+}
+
+//----------------------------------------------------------------------
+// copy plan decisions into pIdxInfo
+//----------------------------------------------------------------------
+static void applyPlan(const QueryPlan &plan, sqlite3_index_info* pIdxInfo) {
+  for (int i=0; i < pIdxInfo->nConstraint; i++) {
+    const QueryPlan::term_usage_t &usage = plan.usage[i];
+    pIdxInfo->aConstraintUsage[i].argvIndex = usage.argvIndex;
+    pIdxInfo->aConstraintUsage[i].omit = (usage.omit ? 1 : 0);
+    if (usage.inList) {
+      takeInList(pIdxInfo, i);
+    }
+  }
+
+  if (plan.orderingIdx >= 0) {
+    pIdxInfo->orderByConsumed = 1;
+  }
+  if (plan.est.cost > 0) {
+    pIdxInfo->estimatedCost = plan.est.cost;
+  }
+  if (plan.est.rows > 0) {
+    pIdxInfo->estimatedRows = plan.est.rows;
+  }
+  if (plan.est.unique) {
+    pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+  }
+}
+
+// plans kept per table for reuse by later statements
+#define MAX_CACHED_PLANS 64
+
+//----------------------------------------------------------------------
+// drop the least recently used plan from the cache
+//----------------------------------------------------------------------
+static void evictPlan(my_vtab* pVT) {
+  auto oldest = pVT->_plans.begin();
+  for (auto it = pVT->_plans.begin(); it != pVT->_plans.end(); it++) {
+    if (it->second.lastUsed < oldest->second.lastUsed) {
+      oldest = it;
+    }
+  }
+  TRACE fprintf(stderr, "   evict plan:%d\n", oldest->second.plan->id);
+  pVT->_plans.erase(oldest);
+  dropExpiredPlanIds(pVT);
+}
+
+//----------------------------------------------------------------------
+// sqlite passes info on query, we respond by populating any
+// indexes that the virtual table will handle.
+//----------------------------------------------------------------------
+static int xBestIndex(sqlite3_vtab* tab, sqlite3_index_info* pIdxInfo) {
+  my_vtab* pVT = (my_vtab*)tab;
+
+  TRACE fprintf(stderr, "xBestIndex '%s' nConstraint:%d idxFlags:0x%x\n",
+                pVT->_implementation->getTableDef().schemaId->name.c_str(),
+                pIdxInfo->nConstraint, pIdxInfo->idxFlags);
+
+  // reuse the plan if this constraint shape has been seen before
+
+  SPQueryPlan spPlan;
+  auto key = planSignature(pIdxInfo);
+  auto it = pVT->_plans.find(key);
+  if (it != pVT->_plans.end()) {
+    spPlan = it->second.plan;
+    it->second.lastUsed = ++pVT->_planClock;
+    TRACE fprintf(stderr, "   cached plan:%d\n", spPlan->id);
+  } else {
+    spPlan = buildPlan(pVT, pIdxInfo);
+    pVT->_plans[key] = { spPlan, ++pVT->_planClock };
+    pVT->_plansById[spPlan->id] = spPlan;
+    if (pVT->_plans.size() > MAX_CACHED_PLANS) {
+      evictPlan(pVT);
+    }
+  }
+
+  if (spPlan->missingRequired) {
+    if (pVT->zErrMsg != nullptr) {
+      sqlite3_free(pVT->zErrMsg);
+    }
+    pVT->zErrMsg = sqlite3_mprintf("required constraint missing");
+    return SQLITE_CONSTRAINT;
+  }
+
+  // keep it for xFilter until the statement is done
+
+  RunningStatement *pStatement = pVT->_owner->currentStatement();
+  if (pStatement != nullptr) {
+    pStatement->addPlan(pVT, spPlan);
+  }
+
+  applyPlan(*spPlan, pIdxInfo);
+  pIdxInfo->idxNum = spPlan->id;
+
+  return SQLITE_OK;
+}
+
+//----------------------------------------------------------------------
+// convenience function
+//----------------------------------------------------------------------
+Constraint _makeConstraint(const constraint_info_t &cinfo, sqlite3_value *val) {
+  Constraint c;
+  c.columnId = cinfo.columnId;
+  c.op = (ConstraintOp)cinfo.op;
+
+  // unary operators have no right-hand value
+
+  if (c.op != OP_ISNULL && c.op != OP_ISNOTNULL) {
+    getSqliteValue(val, c.value);
+  }
+
+  return c;
+}
+
+//----------------------------------------------------------------------
+// one constraint per value of an IN (...) list passed whole
+//----------------------------------------------------------------------
+static void addInListConstraints(const constraint_info_t &cinfo, sqlite3_value *list, std::vector<Constraint> &dest) {
+#if VSQLITE_HAS_VTAB_IN
+  sqlite3_value *val = nullptr;
+  for (int rc = sqlite3_vtab_in_first(list, &val); rc == SQLITE_OK && val != nullptr;
+       rc = sqlite3_vtab_in_next(list, &val)) {
+    dest.push_back(_makeConstraint(cinfo, val));
+  }
+#endif
+}
+
+//----------------------------------------------------------------------
+// Compare values the way sqlite orders them, numbers before text.
+// Returns false if the values are not comparable here (NULL, blob,
+// or mixed number and text, where sqlite applies column affinity).
+//----------------------------------------------------------------------
+static bool compareValues(const DynVal &a, const DynVal &b, int &result) {
+  auto isText = [](DynType t) { return t == TSTRING; };
+  auto isNumber = [](DynType t) { return t != TNONE && t != TSTRING && t != TBYTES; };
+  auto isFloat = [](DynType t) { return t == TFLOAT32 || t == TFLOAT64; };
+
+  if (isText(a.type()) && isText(b.type())) {
+    int cmp = a.as_s().compare(b.as_s());
+    result = (cmp < 0 ? -1 : (cmp > 0 ? 1 : 0));
+    return true;
+  }
+  if (isNumber(a.type()) && isNumber(b.type())) {
+    if (isFloat(a.type()) || isFloat(b.type())) {
+      double x = a.as_double(), y = b.as_double();
+      result = (x < y ? -1 : (x > y ? 1 : 0));
+    } else {
+      int64_t x = a.as_i64(), y = b.as_i64();
+      result = (x < y ? -1 : (x > y ? 1 : 0));
+    }
+    return true;
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------
+// true for types whose values sqlite compares as numbers
+//----------------------------------------------------------------------
+static bool isNumericType(DynType t) {
+  return t != TNONE && t != TSTRING && t != TBYTES;
+}
+
+//----------------------------------------------------------------------
+// true if sqlite compares c the way compareValues() and valueKey()
+// do: with the BINARY collation and a value of the column's type
+// class, so no affinity conversion applies.
+//----------------------------------------------------------------------
+static bool isBinaryComparable(const constraint_info_t &cinfo, const Constraint &c) {
+  DynType colType = c.columnId->typeId;
+  DynType valType = c.value.type();
+  if (!cinfo.binary || colType == TNONE || colType == TBYTES || valType == TBYTES) {
+    return false;
+  }
+  return isNumericType(colType) == isNumericType(valType);
+}
+
+//----------------------------------------------------------------------
+// narrow the context's range for c.columnId by comparison constraint
+// c.  Columns with a constraint that can't be compared here get no
+// range at all, leaving them to the table and sqlite.
+// Returns false if c can never be true (compared to NULL).
+//----------------------------------------------------------------------
+static bool addToRange(QueryContextImpl &ctx, const constraint_info_t &cinfo, const Constraint &c) {
+  bool isLower = (c.op == OP_GT || c.op == OP_GE || c.op == OP_EQ);
+  bool isUpper = (c.op == OP_LT || c.op == OP_LE || c.op == OP_EQ);
+  if (!isLower && !isUpper) {
+    return true;
+  }
+  if (!c.value.valid()) {
+    return false;
+  }
+
+  std::vector<ColumnRange> &ranges = ctx._ranges;
+  auto &unranged = ctx._unranged;
+  if (std::find(unranged.begin(), unranged.end(), c.columnId) != unranged.end()) {
+    return true;
+  }
+  if (!isBinaryComparable(cinfo, c)) {
+    unranged.push_back(c.columnId);
+    ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                                [&c](const ColumnRange &r) { return r.columnId == c.columnId; }),
+                 ranges.end());
+    return true;
+  }
+
+  ColumnRange *pr = nullptr;
+  for (auto &r : ranges) {
+    if (r.columnId == c.columnId) { pr = &r; break; }
+  }
+  if (nullptr == pr) {
+    ranges.push_back({c.columnId, DynVal(), true, DynVal(), true});
+    pr = &ranges.back();
+  }
+
+  int cmp = 0;
+  if (isLower) {
+    bool inclusive = (c.op != OP_GT);
+    if (!pr->lower.valid()) {
+      pr->lower = c.value;
+      pr->lowerInclusive = inclusive;
+    } else if (compareValues(c.value, pr->lower, cmp) && (cmp > 0 || (cmp == 0 && !inclusive))) {
+      pr->lower = c.value;
+      pr->lowerInclusive = inclusive;
+    }
+  }
+  if (isUpper) {
+    bool inclusive = (c.op != OP_LT);
+    if (!pr->upper.valid()) {
+      pr->upper = c.value;
+      pr->upperInclusive = inclusive;
+    } else if (compareValues(c.value, pr->upper, cmp) && (cmp < 0 || (cmp == 0 && !inclusive))) {
+      pr->upper = c.value;
+      pr->upperInclusive = inclusive;
+    }
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------
+// true if no value can satisfy range
+//----------------------------------------------------------------------
+static bool isEmptyRange(const ColumnRange &range) {
+  int cmp = 0;
+  if (!range.lower.valid() || !range.upper.valid() ||
+      !compareValues(range.lower, range.upper, cmp)) {
+    return false;
+  }
+  return (cmp > 0 || (cmp == 0 && !(range.lowerInclusive && range.upperInclusive)));
+}
+
+//----------------------------------------------------------------------
+// LIMIT and OFFSET values combine into the number of rows sqlite
+// will read.  A negative LIMIT means no limit.  LIMIT always
+// precedes OFFSET in argv.
+//----------------------------------------------------------------------
+static void addLimitHint(std::shared_ptr<QueryContextImpl> spContext, unsigned char op, sqlite3_value *val) {
+  int64_t n = sqlite3_value_int64(val);
+  if (op == OP_LIMIT) {
+    if (n < 0) {
+      spContext->_rowLimit = -1;
+      return;
+    }
+    spContext->_rowLimit = n;
+  } else if (n > 0 && spContext->_rowLimit >= 0) {
+    spContext->_rowLimit += n;
+  }
+}
+
+//----------------------------------------------------------------------
+// call table's next() and advance rowId if data
+// sqlite will call xEof, which checks for pVC->_eof
+// and if NOT xEof, then will call xColumn to get all
+// columns
+//----------------------------------------------------------------------
+static inline void advanceRow(my_vtab_cursor* pVC) {
+  TRACE fprintf(stderr, " call next() idxNum:%d _rowId:%llu\n", pVC->_context->_plan->id, pVC->_pvt->_rowId);
+  if (pVC->_source) {
+    pVC->_eof = !pVC->_source->next(pVC->_row);
+  } else {
+    pVC->_row.clear();
+    pVC->_eof = !pVC->_pvt->_implementation->nextRow(pVC->_context, pVC->_row);
+  }
+  if (pVC->_eof) {
+    pVC->_row.clear();
+  } else {
+    pVC->_pvt->_rowId++;
+  }
+}
+// contexts kept per table for reuse
+#define MAX_POOLED_CONTEXTS 8
+
+// rows buffered ahead of sqlite by a PIPELINE table
+#define PIPELINE_QUEUE_ROWS 64
+
+// lookups queued ahead of the cursor by a PARALLEL_LOOKUP table
+#define PARALLEL_LOOKUPS_PER_THREAD 2
+
+// rows buffered ahead of sqlite by a PARTITIONED table
+#define PARTITION_QUEUE_ROWS 256
+
+// join keys passed to one lookupBatch() call
+#define BATCH_LOOKUP_KEYS 256
+
+//----------------------------------------------------------------------
+// cancel and join any worker threads of the cursor
+//----------------------------------------------------------------------
+static void stopSource(my_vtab_cursor* pVC) {
+  if (pVC->_source) {
+    pVC->_source->cancel();
+    pVC->_source.reset();
+  }
+  pVC->_scan.reset();
+}
+
+//----------------------------------------------------------------------
+// Return cursor's context to the table's pool, unless the table
+// implementation still holds a reference to it.  Constraint
+// vectors keep their capacity and state<T>() keeps its object,
+// reset so the data of the last scan is not held in the pool.
+//----------------------------------------------------------------------
+static void releaseContext(my_vtab_cursor* pVC) {
+  if (nullptr == pVC->_context) {
+    return;
+  }
+  auto &pool = pVC->_pvt->_contextPool;
+  if (pVC->_context.use_count() == 1 && pool.size() < MAX_POOLED_CONTEXTS) {
+    QueryContextImpl &ctx = *pVC->_context;
+    ctx._plan.reset();
+    ctx._constraints.clear();
+    ctx._ranges.clear();
+    ctx._unranged.clear();
+    ctx._userData.reset();
+    ctx.resetState();
+    ctx._rowLimit = -1;
+    pool.push_back(pVC->_context);
+  }
+  pVC->_context.reset();
+}
+
+//----------------------------------------------------------------------
+// context for one of several concurrent prepare() calls of a cursor
+//----------------------------------------------------------------------
+static std::shared_ptr<QueryContextImpl> copyContext(const QueryContextImpl &base) {
+  auto spCopy = std::make_shared<QueryContextImpl>();
+  spCopy->_plan = base._plan;
+  spCopy->_requestIndex = base._requestIndex;
+  spCopy->_constraints = base._constraints;
+  spCopy->_ranges = base._ranges;
+  spCopy->_unranged = base._unranged;
+  return spCopy;
+}
+
+//----------------------------------------------------------------------
+// Give each lookup value its own context, holding the cursor's
+// constraints plus the one OP_EQ, as if sqlite had called xFilter
+// once per value.  Values that cannot match are dropped.
+//----------------------------------------------------------------------
+static void startLookups(my_vtab_cursor* pVC, const std::vector<Constraint> &lookups) {
+  std::vector<SPQueryContext> contexts;
+  contexts.reserve(lookups.size());
+
+  const constraint_info_t &cinfo = pVC->_context->_plan->constraint_infos[pVC->_context->_plan->fanoutArg];
+  for (auto &c : lookups) {
+    auto spLookup = copyContext(*pVC->_context);
+    spLookup->_constraints.push_back(c);
+    if (!addToRange(*spLookup, cinfo, c)) {
+      continue;
+    }
+    bool empty = false;
+    for (auto &range : spLookup->_ranges) {
+      empty = empty || isEmptyRange(range);
+    }
+    if (!empty) {
+      contexts.push_back(spLookup);
+    }
+  }
+
+  ThreadPool &pool = ThreadPool::shared();
+  pVC->_source.reset(new OrderedParallelRowSource(pVC->_pvt->_implementation, contexts, pVC->_row,
+                                                 pool, pool.size() * PARALLEL_LOOKUPS_PER_THREAD));
+}
+
+//----------------------------------------------------------------------
+// Scan numPartitions copies of the cursor's context concurrently.
+// Each gets the row limit, since any one partition may end up
+// providing all the rows sqlite reads.
+//----------------------------------------------------------------------
+static void startPartitions(my_vtab_cursor* pVC, size_t numPartitions) {
+  std::vector<SPQueryContext> contexts;
+  contexts.reserve(numPartitions);
+
+  for (size_t i=0; i < numPartitions; i++) {
+    auto spPartition = copyContext(*pVC->_context);
+    spPartition->_rowLimit = pVC->_context->_rowLimit;
+    spPartition->_partition = (int)i;
+    contexts.push_back(spPartition);
+  }
+
+  VirtualTable *impl = pVC->_pvt->_implementation;
+  ThreadPool &pool = ThreadPool::shared();
+  if (pVC->_pvt->_partitionsOrdered) {
+    pVC->_source.reset(new OrderedParallelRowSource(impl, contexts, pVC->_row, pool, pool.size()));
+  } else {
+    pVC->_source.reset(new UnorderedParallelRowSource(impl, contexts, pVC->_row, pool, PARTITION_QUEUE_ROWS));
+  }
 }
 
 //----------------------------------------------------------------------
-// open cursor
+// Hash key for matching xFilter values with row values, for
+// lookupBatch() results and transient indexes.  Numbers that are
+// equal in sqlite get the same key.  Text never matches a number.
 //----------------------------------------------------------------------
-static int xOpen(sqlite3_vtab* tab, sqlite3_vtab_cursor** ppCursor) {
-  auto pCur = new my_vtab_cursor((my_vtab*)tab);
-  *ppCursor = pCur;
-  return SQLITE_OK;
+static std::string valueKey(const DynVal &value) {
+  switch (value.type()) {
+    case TSTRING:
+      return "s" + value.as_s();
+    case TBYTES:
+      return "b" + value.as_s();
+    case TFLOAT32:
+    case TFLOAT64: {
+      double d = value.as_double();
+      if (d > -9.2e18 && d < 9.2e18 && d == (double)(int64_t)d) {
+        return "i" + std::to_string((int64_t)d);
+      }
+      char buf[32];
+      snprintf(buf, sizeof(buf), "d%.17g", d);
+      return buf;
+    }
+    default:
+      return "i" + std::to_string(value.as_i64());
+  }
 }
 
 //----------------------------------------------------------------------
-// get index of fieldId in columns
+// Identifies a CACHEABLE scan within a statement: the plan, row
+// limit hint and every constraint value, including IN list lookups.
 //----------------------------------------------------------------------
-static int getIndexOfColumn(SPFieldDef fieldId, const TableDef &tableDef) {
-  for (int i=0; i < tableDef.columns.size();i++) {
-    if (tableDef.columns[i].id == fieldId) {
-      return i;
+static std::string scanKey(const QueryContextImpl &ctx, const std::vector<Constraint> &lookups) {
+  std::string key = std::to_string(ctx._plan->id) + "/" + std::to_string(ctx._rowLimit);
+  for (auto *pcs : { &ctx._constraints, &lookups }) {
+    key += "|";
+    for (auto &c : *pcs) {
+      std::string val = c.value.valid() ? valueKey(c.value) : "n";
+      key += "/" + c.columnId->name + ":" + std::to_string((int)c.op) + ":" + std::to_string(val.size()) + ":" + val;
     }
   }
-  return -1;
+  return key;
 }
 
+/*
+ * BatchRows for lookupBatch(), rows grouped by key
+ */
+struct BatchRowsImpl : public BatchRows {
+  BatchRowsImpl(const Row &prototype, size_t numKeys) : _prototype(prototype), _discard(prototype), rows(numKeys) {
+    _prototype.clear();
+  }
+  Row &addRow(size_t keyIdx) override {
+    if (keyIdx >= rows.size()) {
+      _discard.clear();
+      return _discard;
+    }
+    rows[keyIdx].push_back(_prototype);
+    return rows[keyIdx].back();
+  }
+  Row _prototype;
+  Row _discard;
+  std::vector<std::vector<Row> > rows;
+};
+
 //----------------------------------------------------------------------
-// op
+// true if plan is a single OP_EQ lookup, that lookupBatch() can do
 //----------------------------------------------------------------------
-static inline std::string opString(unsigned char op) {
-  switch (op) {
-    case SQLITE_INDEX_CONSTRAINT_EQ:
-      return "=";
-    case SQLITE_INDEX_CONSTRAINT_GT:
-      return ">";
-    case SQLITE_INDEX_CONSTRAINT_LE:
-      return "<=";
-    case SQLITE_INDEX_CONSTRAINT_LT:
-      return "<";
-    case SQLITE_INDEX_CONSTRAINT_GE:
-      return ">=";
-    case SQLITE_INDEX_CONSTRAINT_LIKE:
-      return "LIKE";
-    case SQLITE_INDEX_CONSTRAINT_MATCH:
-      return "MATCH";
-    case SQLITE_INDEX_CONSTRAINT_GLOB:
-      return "GLOB";
-    case SQLITE_INDEX_CONSTRAINT_REGEXP:
-      return "REGEX";
-    default:
-      break;
-  }
-  return "?";
+static bool isBatchablePlan(const QueryPlan &plan) {
+  const std::vector<constraint_info_t> &infos = plan.constraint_infos;
+  return (infos.size() == 1 && infos[0].op == SQLITE_INDEX_CONSTRAINT_EQ &&
+          !infos[0].inList && infos[0].binary);
 }
 
 //----------------------------------------------------------------------
-// sqlite passes info on query, we respond by populating any
-// indexes that the virtual table will handle.
+// Find the join columns of lookup value c: columns of the current
+// row of a prefetched scan in the statement that hold the same
+// value.  Collect their values from that row and the rows the scan
+// has yet to return, up to BATCH_LOOKUP_KEYS distinct ones, and look
+// them up at once.  The rows are not filtered yet, so sqlite may
+// reject some of them; the limit bounds the lookups wasted on those.
+// If no scan matches, the batch stays empty and lookups call
+// prepare().
 //----------------------------------------------------------------------
-static int xBestIndex(sqlite3_vtab* tab, sqlite3_index_info* pIdxInfo) {
-  my_vtab* pVT = (my_vtab*)tab;
-  int numRequiredConstraints = 0;
-  int numIndexedConstraints = 0;
-  int numRequiredColumns = 0;
-  int numIndexedColumns = 0;
-  int xFilterArgvIndex = 0;
-
-  auto spContext = std::make_shared<QueryContextImpl>();
-  spContext->_idxNum = kConstraintIndexID++;
-//  pVT->_colsUsed.clear();
-//  pVT->_constraints.clear();
+static void loadBatch(my_vtab_cursor* pVC, const Constraint &c, BatchLookup &batch) {
+  std::vector<DynVal> keys;
+  std::vector<std::string> keyStrings;
+  std::set<std::string> seen;
+  auto addKey = [&](const DynVal *pval) {
+    if (pval != nullptr && pval->valid() && keys.size() < BATCH_LOOKUP_KEYS &&
+        seen.insert(valueKey(*pval)).second) {
+      keys.push_back(*pval);
+      keyStrings.push_back(valueKey(*pval));
+    }
+  };
 
-  TRACE fprintf(stderr, "%sxBestIndex '%s' nConstraint:%d idxNum:%d idxFlags:0x%x\n",
-                _TINDENT(spContext).c_str(), pVT->_implementation->getTableDef().schemaId->name.c_str(),
-                pIdxInfo->nConstraint, spContext->_idxNum,
-                pIdxInfo->idxFlags);
+  batch.rows.clear();
+
+  std::string lookupKey = valueKey(c.value);
+  for (auto pOuter : pVC->_statement->_cursors) {
+    if (pOuter == pVC || !pOuter->_scan || pOuter->_eof) { continue; }
+    const TableDef &td = pOuter->_pvt->_implementation->getTableDef();
+    std::vector<Row> &rows = pOuter->_scan->wait();
+    for (size_t col=0; col < td.columns.size(); col++) {
+      const DynVal *pval = pOuter->_row.find(td.columns[col].id);
+      if (pval == nullptr || !pval->valid() || valueKey(*pval) != lookupKey) { continue; }
+      TRACE fprintf(stderr, "    join column %s.%s\n", td.schemaId->name.c_str(), td.columns[col].id->name.c_str());
+      addKey(pval);
+      for (size_t i = pOuter->_scan->position(); i < rows.size() && keys.size() < BATCH_LOOKUP_KEYS; i++) {
+        addKey(rows[i].find(td.columns[col].id));
+      }
+    }
+  }
+  if (keys.empty()) {
+    return;
+  }
 
-  const TableDef & td = pVT->_implementation->getTableDef();
+  auto spContext = copyContext(*pVC->_context);
+  spContext->_constraints.clear();
+  spContext->_ranges.clear();
+  spContext->_unranged.clear();
 
-  // gather constraints
+  BatchRowsImpl result(pVC->_row, keys.size());
+  if (!pVC->_pvt->_implementation->lookupBatch(spContext, c.columnId, keys, result)) {
+    batch.declined = true;
+    return;
+  }
+  TRACE fprintf(stderr, "    lookupBatch() keys:%d\n", (int)keys.size());
+  for (size_t i=0; i < keys.size(); i++) {
+    batch.rows[keyStrings[i]] = std::make_shared<const std::vector<Row> >(std::move(result.rows[i]));
+  }
+}
 
-  if (pIdxInfo->nConstraint > 0) {
-    for (size_t i = 0; i < static_cast<size_t>(pIdxInfo->nConstraint); ++i) {
-      const sqlite3_index_info::sqlite3_index_constraint &constraint_info = pIdxInfo->aConstraint[i];
+//----------------------------------------------------------------------
+// Scan the whole table once, hashing rows by column colIdx.
+//----------------------------------------------------------------------
+static void buildTransientIndex(my_vtab_cursor* pVC, int colIdx, TransientIndex &index) {
+  VirtualTable *impl = pVC->_pvt->_implementation;
+  const ColumnDef &coldef = impl->getTableDef().columns[colIdx];
+  TRACE fprintf(stderr, "    building transient index on %s\n", coldef.id->name.c_str());
 
-      if (constraint_info.iColumn >= td.columns.size()) {
-        continue;
+  auto spContext = copyContext(*pVC->_context);
+  spContext->_constraints.clear();
+  spContext->_ranges.clear();
+  spContext->_unranged.clear();
+  impl->prepare(spContext);
+
+  std::unordered_map<std::string, std::vector<Row> > grouped;
+  Row row(pVC->_row);
+  row.clear();
+  while (impl->nextRow(spContext, row)) {
+    const DynVal *pval = row.find(coldef.id);
+    if (pval != nullptr && pval->valid()) {
+      if (isNumericType(pval->type()) != isNumericType(coldef.id->typeId)) {
+        index.usable = false;
       }
-      if (constraint_info.usable == 0) { continue; }
-
-      // get column def, dealing with aliases
+      grouped[valueKey(*pval)].push_back(row);
+    }
+    row.clear();
+  }
 
-      const ColumnDef *pcoldef = &td.columns[constraint_info.iColumn];
-      if (pcoldef->aliased) {
-        int j = getIndexOfColumn(pcoldef->aliased, td);
-        if (j < 0) {
-          // TODO: error
-          continue;
-        }
-        pcoldef = &td.columns[j];
-      }
+  for (auto &item : grouped) {
+    index.rows[item.first] = std::make_shared<const std::vector<Row> >(std::move(item.second));
+  }
+  index.built = true;
+}
 
-      TRACE fprintf(stderr, "%s   icol:%d (%s) op:%s termOffset:%d\n", _TINDENT(spContext).c_str(), constraint_info.iColumn, pcoldef->id->name.c_str(), opString(constraint_info.op).c_str(), constraint_info.iTermOffset );
+//----------------------------------------------------------------------
+// Serve the rows matching the cursor's OP_EQ constraint from the
+// plan's transient index.  Returns false if the index can't answer,
+// e.g. text compared to a number column, where sqlite converts
+// values.  Then the caller scans the table as usual.
+//----------------------------------------------------------------------
+static bool serveFromTransientIndex(my_vtab_cursor* pVC) {
+  QueryContextImpl &ctx = *pVC->_context;
+  int colIdx = ctx._plan->autoIndexCol;
+  const ColumnDef &coldef = pVC->_pvt->_implementation->getTableDef().columns[colIdx];
 
-      if ((pcoldef->options & (INDEXED | REQUIRED | ADDITIONAL)) == 0) {
-        TRACE fprintf(stderr, "%s   No such index implemented\n", _TINDENT(spContext).c_str());
-        continue;
-      }
+  static const std::shared_ptr<const std::vector<Row> > kNoRows = std::make_shared<const std::vector<Row> >();
 
-      // does vtable support the constraint?
+  const Constraint *pc = ctx.findConstraint(coldef.id, OP_EQ);
+  if (nullptr == pc) {
+    return false;
+  }
+  if (!pc->value.valid()) {
+    pVC->_source.reset(new SharedRowSource(kNoRows));  // = NULL is never true
+    return true;
+  }
+  if (isNumericType(pc->value.type()) != isNumericType(coldef.id->typeId)) {
+    return false;
+  }
 
-      if (pcoldef->indexOpsImplemented.empty()) {
-        if (constraint_info.op != SQLITE_INDEX_CONSTRAINT_EQ) {
-          continue;
-        }
-      } else {
-        std::vector<int> dd;
-        if (pcoldef->indexOpsImplemented.find((ConstraintOp)constraint_info.op) == pcoldef->indexOpsImplemented.end()) {
-          continue;
-        }
-      }
+  if (nullptr == pVC->_statement) {
+    return false;
+  }
+  // sqlite can't tell xBestIndex whether the value is a bound
+  // parameter or a column of an outer table.  The first lookup
+  // scans as usual, a plan filtered again is a join and is indexed.
+
+  auto &spIndex = pVC->_statement->_transientIndexes[std::make_pair(pVC->_pvt, ctx._plan->id)];
+  if (!spIndex) {
+    spIndex = std::make_shared<TransientIndex>();
+    return false;
+  }
+  if (!spIndex->built) {
+    buildTransientIndex(pVC, colIdx, *spIndex);
+  }
+  if (!spIndex->usable) {
+    return false;
+  }
 
-      // mark use
+  auto it = spIndex->rows.find(valueKey(pc->value));
+  pVC->_source.reset(new SharedRowSource(it != spIndex->rows.end() ? it->second : kNoRows));
+  return true;
+}
 
-      if (pcoldef->options & REQUIRED) {
-        numRequiredConstraints ++;
-      }
-      else {
-          if (pcoldef->options & (INDEXED | ADDITIONAL)) {
-            numIndexedConstraints ++;
-          }
-      }
+//----------------------------------------------------------------------
+// true if plans a and b read the same rows without constraints
+//----------------------------------------------------------------------
+static bool isSameScan(const QueryPlan &a, const QueryPlan &b) {
+  return a.constraint_infos.empty() && b.constraint_infos.empty() &&
+         a.orderingIdx == b.orderingIdx && a.colsUsed == b.colsUsed;
+}
 
-      // save constraint
+//----------------------------------------------------------------------
+// Plan of pVT's cursors in statement, if every plan xBestIndex
+// handed to sqlite for the table is the same unconstrained scan.
+// Whichever one sqlite chose, the cursors then scan the whole table.
+//----------------------------------------------------------------------
+static SPQueryPlan certainScanPlan(RunningStatement &statement, my_vtab *pVT) {
+  auto it = statement._plans.find(pVT);
+  if (it == statement._plans.end() || it->second.empty()) {
+    return nullptr;
+  }
+  for (auto &spPlan : it->second) {
+    if (!isSameScan(*it->second[0], *spPlan)) {
+      return nullptr;
+    }
+  }
+  return it->second[0];
+}
 
-      pIdxInfo->aConstraintUsage[i].argvIndex = ++xFilterArgvIndex;
+//----------------------------------------------------------------------
+// true if a BATCH_LOOKUP cursor of statement may run a lookup that
+// lookupBatch() can answer
+//----------------------------------------------------------------------
+static bool hasBatchLookup(RunningStatement &statement) {
+  for (auto pCur : statement._cursors) {
+    if (!pCur->_pvt->_batchLookup) { continue; }
+    for (auto &spPlan : statement._plans[pCur->_pvt]) {
+      if (isBatchablePlan(*spPlan)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
 
-      spContext->_constraint_infos.push_back({pcoldef->id, constraint_info.iColumn, constraint_info.iTermOffset, constraint_info.op});
+//----------------------------------------------------------------------
+// Start scans of PREFETCH table cursors certain to be unconstrained
+// ahead of sqlite, if there are two or more.  With a single scan
+// there is nothing to overlap, and buffering it would only defeat
+// LIMIT.  If the statement looks up a BATCH_LOOKUP table, a single
+// scan is started too, so its join keys are known at the first
+// lookup.  Tables without PREFETCH are never scanned on the pool.
+// Called at the statement's first xFilter, when sqlite has opened
+// the cursors of its loops.  Each scan is taken by its cursor's
+// first xFilter, or cancelled when the cursor closes.
+//----------------------------------------------------------------------
+static void startPrefetch(RunningStatement &statement) {
+  bool batchLookup = hasBatchLookup(statement);
+  std::vector<std::pair<my_vtab_cursor*, SPQueryPlan> > scans;
+  for (auto pCur : statement._cursors) {
+    if (!pCur->_pvt->_prefetchable) { continue; }
+    SPQueryPlan spPlan = certainScanPlan(statement, pCur->_pvt);
+    if (spPlan) {
+      scans.push_back(std::make_pair(pCur, spPlan));
     }
   }
+  if (scans.empty() || (scans.size() < 2 && !batchLookup)) {
+    return;
+  }
 
-  // track columns requested, so vtables can optimize out work if needed
+  for (auto &scan : scans) {
+    my_vtab *pVT = scan.first->_pvt;
+    TRACE fprintf(stderr, "prefetch '%s' idxNum:%d\n", pVT->_implementation->getTableDef().schemaId->name.c_str(), scan.second->id);
+    auto spContext = std::make_shared<QueryContextImpl>();
+    spContext->_plan = scan.second;
+    spContext->_requestIndex = &pVT->_requestIndex;
+
+    auto spScan = std::make_shared<PrefetchScan>(pVT->_implementation, spContext, scan.first->_row);
+    spScan->start(ThreadPool::shared());
+    scan.first->_prefetch = spScan;
+    scan.first->_prefetchPlan = scan.second;
+  }
+}
 
-  for (int i=0; i < td.columns.size(); i++) {
-    const ColumnDef *pcoldef = &td.columns[i];
+//----------------------------------------------------------------------
+// Start producing rows for the cursor's constraints, either by
+// setting pVC->_source or by calling the table's prepare().
+//----------------------------------------------------------------------
+static void startScan(my_vtab_cursor* pVC, int idxNum, int argc, std::vector<Constraint> &lookups) {
+  auto pVT = pVC->_pvt;
+  std::shared_ptr<QueryContextImpl> spContext = pVC->_context;
 
-    // handle column aliases
+  // unconstrained scan already run ahead of sqlite
 
-    if (pcoldef->aliased) {
-      int actualColIdx = getIndexOfColumn(pcoldef->aliased, td);
-      if (actualColIdx < 0) {
-        // TODO: log error
-        continue;
-      }
-      pcoldef = &td.columns[actualColIdx];
-    } else {
+  if (pVC->_prefetch) {
+    auto spScan = std::move(pVC->_prefetch);
+    if (argc == 0 && isSameScan(*pVC->_prefetchPlan, *spContext->_plan)) {
+      TRACE fprintf(stderr, "    using prefetched scan\n");
+      pVC->_source.reset(new PrefetchRowSource(spScan));
+      pVC->_scan = spScan;
+      return;
+    }
+    spScan->cancel();
+  }
 
-      // only count these for non-aliased columns
+  // lookup in a transient index, built on second use
 
-      if (pcoldef->options & (INDEXED | ADDITIONAL)) {
-        numIndexedColumns++;
-      }
-      if (pcoldef->options & (REQUIRED)) {
-        numRequiredColumns++;
-      }
+  if (spContext->_plan->autoIndexCol >= 0) {
+    if (serveFromTransientIndex(pVC)) {
+      return;
     }
+    spContext->_constraints.clear();
+    spContext->_ranges.clear();
+    spContext->_unranged.clear();
+  }
 
-    // track columns used
-
-    if (pIdxInfo->colUsed & (1LL << i)) {
+  // join lookup, answered from a lookupBatch() call.  Values
+  // sqlite compares otherwise than valueKey() does are not.
 
-      spContext->_colsUsed.insert(pcoldef->id);
-      //fprintf(stderr, "column used:'%s'\n", pcoldef->id->name.c_str());
+  if (pVT->_batchLookup && pVC->_statement != nullptr && isBatchablePlan(*spContext->_plan) &&
+      spContext->_constraints.size() == 1 &&
+      isBinaryComparable(spContext->_plan->constraint_infos[0], spContext->_constraints[0])) {
+    const Constraint &c = spContext->_constraints[0];
+    if (!pVC->_batch || pVC->_batch->plan != spContext->_plan) {
+      pVC->_batch.reset(new BatchLookup());
+      pVC->_batch->plan = spContext->_plan;
+    }
+    BatchLookup &batch = *pVC->_batch;
+    auto rit = batch.rows.find(valueKey(c.value));
+    if (rit == batch.rows.end() && !batch.declined) {
+      // first lookup, or past the keys of the last batch
+      loadBatch(pVC, c, batch);
+      rit = batch.rows.find(valueKey(c.value));
+    }
+    if (rit != batch.rows.end()) {
+      pVC->_source.reset(new SharedRowSource(rit->second));
+      return;
     }
   }
 
-  if (numRequiredConstraints < numRequiredColumns) {
-    if (pVT->zErrMsg != nullptr) {
-      sqlite3_free(pVT->zErrMsg);
+  // one lookup per IN value, on the thread pool
+
+  if (spContext->_plan->fanoutArg >= 0) {
+    startLookups(pVC, lookups);
+    return;
+  }
+
+  // partitions scanned on the thread pool
+
+  if (pVT->_partitioned) {
+    size_t numPartitions = pVT->_implementation->getPartitionCount(spContext);
+    if (numPartitions > 1) {
+      startPartitions(pVC, numPartitions);
+      return;
     }
-    TRACE fprintf(stderr, "%sRequired constraint missing\n", _TINDENT(spContext).c_str());
-    pVT->zErrMsg = sqlite3_mprintf("required constraint missing");
-    return SQLITE_CONSTRAINT;
   }
 
-  pIdxInfo->idxNum = static_cast<int>(spContext->_idxNum);//   kConstraintIndexID++);
-  pVT->_contexts.push_back(spContext);
-  if (xFilterArgvIndex > 0) {
-    pIdxInfo->estimatedCost = 10000;
+  // rows produced on the cursor's worker thread, prepare() is called there
+
+  if (pVT->_pipelined) {
+    if (!pVC->_pipeline) {
+      pVC->_pipeline.reset(new PipelineWorker(pVT->_implementation, pVC->_row, PIPELINE_QUEUE_ROWS));
+    }
+    pVC->_source.reset(new PipelineRowSource(*pVC->_pipeline, spContext));
+    return;
   }
 
-  return SQLITE_OK;
-}
+  // call vtable's prepare.  xColumn can use writeColumn(),
+  // unless the rows are recorded.
 
-//----------------------------------------------------------------------
-// convenience function
-//----------------------------------------------------------------------
-Constraint _makeConstraint(constraint_info_t &cinfo, sqlite3_value *val) {
-  Constraint c;
-  c.columnId = cinfo.columnId;
-  c.op = (ConstraintOp)cinfo.op;
-  getSqliteValue(val, c.value);
+  spContext->_rowNeeded = (pVT->_cacheable && pVC->_statement != nullptr);
+  pVT->_implementation->prepare(spContext);
 
-  return c;
 }
 
 //----------------------------------------------------------------------
-// call table's next() and advance rowId if data
-// sqlite will call xEof, which  checks for pVC->_row.empty()
-// and if NOT xEof, then will call xColumn to get all
-// columns
-//----------------------------------------------------------------------
-  static inline void advanceRow(my_vtab_cursor* pVC) {
-  pVC->_row.clear();
-    TRACE fprintf(stderr, "%s call next() idxNum:%d _rowId:%llu\n", _TINDENT(pVC->_context).c_str(), pVC->_context->_idxNum, pVC->_pvt->_rowId);
-    if (pVC->_pvt->_implementation->next(std::static_pointer_cast<QueryContext>(pVC->_context), pVC->_row) && !pVC->_row.empty()) {
-    pVC->_pvt->_rowId++;
-  }
-}
-#define MAX_CONTEXT_BACKLOG 20
-//----------------------------------------------------------------------
-// Called after xBestIndex, but not always?
-// TODO: cleanup spContext that are created in xBestIndex, but
-// sqlite chooses not to use (and then xFilter not called).
+// Called with the idxNum of the plan sqlite chose in xBestIndex.
+// Each cursor has its own context, created on first use.
 //----------------------------------------------------------------------
 static int xFilter(sqlite3_vtab_cursor* psvCur,
                    int idxNum,
@@ -349,62 +1761,126 @@ static int xFilter(sqlite3_vtab_cursor* psvCur,
   auto pVC = (my_vtab_cursor*)psvCur;
   auto pVT = pVC->_pvt;
 
-  TRACE fprintf(stderr, "%sxFilter idxNum:%d argc:%d\n", _TINDENT(idxNum).c_str(), idxNum, argc);
-  std::shared_ptr<QueryContextImpl> spContext;
+  TRACE fprintf(stderr, "xFilter idxNum:%d argc:%d\n", idxNum, argc);
 
-  // allow next xBestIndex to know what first index id is
-  gQueryStartIndex = kConstraintIndexID;
+  // stop workers still using the context from the last xFilter
 
-  // find matching context setup in xBestIndex
-  // while we are at it, erase old contexts
+  stopSource(pVC);
 
-  for (auto it = pVT->_contexts.begin(); it != pVT->_contexts.end();) {
+  // all cursors of the statement's loops are open now
 
-    // erase 'old' context, based on idxNum.
-    // How many can be in-flight at same time?
-    // Can have several for a given query or subquery.
-
-    if ((*it)->_idxNum < (idxNum - MAX_CONTEXT_BACKLOG)) {
-      pVT->_contexts.erase(it++);
-      continue;
-    }
+  if (pVC->_statement != nullptr && !pVC->_statement->_filtered) {
+    pVC->_statement->_filtered = true;
+    startPrefetch(*pVC->_statement);
+  }
 
-    if ((*it)->_idxNum == idxNum) {
-      spContext = *it;
-      break;
-    }
+  // find plan chosen in xBestIndex
 
-    it++;
+  SPQueryPlan spPlan;
+  auto it = pVT->_plansById.find(idxNum);
+  if (it != pVT->_plansById.end()) {
+    spPlan = it->second.lock();
+  }
+  if (nullptr == spPlan) {
+    fprintf(stderr, "state ERROR : plan not found in xFilter idxNum:%d\n", idxNum);
+    return SQLITE_ERROR;
   }
 
-  // did we find it?
+  // a cursor may be re-filtered with a different plan
 
-  if (nullptr == spContext) {
-    fprintf(stderr, "state ERROR : context not found in xFilter idxNum:%d\n", idxNum);
-    return SQLITE_ERROR;
+  if (nullptr == pVC->_context || pVC->_context->_plan != spPlan) {
+    releaseContext(pVC);
+    if (!pVT->_contextPool.empty()) {
+      pVC->_context = pVT->_contextPool.back();
+      pVT->_contextPool.pop_back();
+    } else {
+      pVC->_context = std::make_shared<QueryContextImpl>();
+    }
+    pVC->_context->_plan = spPlan;
+    pVC->_context->_requestIndex = &pVT->_requestIndex;
   }
+  std::shared_ptr<QueryContextImpl> spContext = pVC->_context;
 
   // xFilter will be called multiple times for OP_EQ indexes
   // with the same cursor, and thus the same Constraints state.
   // so clear constraints. each time.
   spContext->_constraints.clear();
+  spContext->_ranges.clear();
+  spContext->_unranged.clear();
+  spContext->_rowLimit = -1;
+  spContext->_rowNeeded = true;
+  spContext->markStateStale();
+  bool emptyRange = false;
+  std::vector<Constraint> lookups;  // values of plan's fanoutArg
 
   // add filter constraints to context
 
-  if (argc > 0 && !spContext->_constraint_infos.empty()) {
-    if (argc > spContext->_constraint_infos.size()) {
+  const std::vector<constraint_info_t> &constraint_infos = spContext->_plan->constraint_infos;
+  if (argc > 0 && !constraint_infos.empty()) {
+    if (argc > constraint_infos.size()) {
       // not good
     } else {
       for (int i=0; i < argc; i++) {
-        TRACE fprintf(stderr, "%s    argv[%d]='%s'\n", _TINDENT(idxNum).c_str(), i, sqlite3_value_text(argv[i]));
-        spContext->_constraints.push_back(_makeConstraint(spContext->_constraint_infos[i], argv[i]));
+        TRACE fprintf(stderr, "    argv[%d]='%s'\n", i, sqlite3_value_text(argv[i]));
+        const constraint_info_t &cinfo = constraint_infos[i];
+        if (isLimitOp(cinfo.op)) {
+          addLimitHint(spContext, cinfo.op, argv[i]);
+          continue;
+        }
+        if (cinfo.inList) {
+          std::vector<Constraint> &dest = (i == spContext->_plan->fanoutArg ? lookups : spContext->_constraints);
+          addInListConstraints(cinfo, argv[i], dest);
+          continue;
+        }
+        spContext->_constraints.push_back(_makeConstraint(cinfo, argv[i]));
+        if (!addToRange(*spContext, cinfo, spContext->_constraints.back())) {
+          emptyRange = true;
+        }
       }
     }
   }
 
-  // call vtable's prepare
-  pVC->_context = spContext;
-  pVC->_pvt->_implementation->prepare(spContext);
+  for (auto &range : spContext->_ranges) {
+    if (isEmptyRange(range)) {
+      emptyRange = true;
+    }
+  }
+
+  // no row can match, don't bother the table
+
+  if (emptyRange) {
+    TRACE fprintf(stderr, "    empty range, skipping prepare()\n");
+    pVC->_row.clear();
+    pVC->_eof = true;
+    return SQLITE_OK;
+  }
+
+  // repeated scan of this statement, served from its snapshot
+
+  RunningStatement *pStatement = pVC->_statement;
+  bool cacheable = (pVT->_cacheable && pStatement != nullptr);
+  std::pair<my_vtab*, std::string> snapshotKey;
+  if (cacheable) {
+    snapshotKey = std::make_pair(pVT, scanKey(*spContext, lookups));
+    auto sit = pStatement->_snapshots.find(snapshotKey);
+    if (sit != pStatement->_snapshots.end()) {
+      TRACE fprintf(stderr, "    using snapshot of %d rows\n", (int)sit->second->size());
+      pVC->_source.reset(new SharedRowSource(sit->second));
+      advanceRow(pVC);
+      return SQLITE_OK;
+    }
+  }
+
+  startScan(pVC, idxNum, argc, lookups);
+
+  // first scan with these constraints, keep its rows
+
+  if (cacheable) {
+    pVC->_source.reset(new RecordingRowSource(pVT->_implementation, spContext, std::move(pVC->_source),
+        [pStatement, snapshotKey](std::shared_ptr<const std::vector<Row> > rows) {
+          pStatement->_snapshots.emplace(snapshotKey, rows);
+        }));
+  }
 
   // get first row, if there is one.
 
@@ -424,6 +1900,29 @@ static int xNext(sqlite3_vtab_cursor* psvCur) {
   return SQLITE_OK;
 }
 
+/*
+ * ColumnResult for xColumn
+ */
+struct SqliteColumnResult : public ColumnResult {
+  SqliteColumnResult(sqlite3_context* ctx) : _ctx(ctx) {}
+  void setNull() override {
+    sqlite3_result_null(_ctx);
+  }
+  void setInt64(int64_t value) override {
+    sqlite3_result_int64(_ctx, value);
+  }
+  void setDouble(double value) override {
+    sqlite3_result_double(_ctx, value);
+  }
+  void setText(const char *value, size_t len) override {
+    sqlite3_result_text(_ctx, value, (int)len, SQLITE_TRANSIENT);
+  }
+  void setBlob(const void *value, size_t len) override {
+    sqlite3_result_blob(_ctx, value, (int)len, SQLITE_TRANSIENT);
+  }
+  sqlite3_context* _ctx;
+};
+
 //----------------------------------------------------------------------
 // to preserve types, a callback mechanism is used.
 // for each column (0 ... n) call the sqlite3_result_$type()
@@ -450,12 +1949,36 @@ static int xColumn(sqlite3_vtab_cursor* psvCur, sqlite3_context* ctx, int col) {
 
   const ColumnDef &colDef = tableDef.columns[col];
 
-  auto fit = pVC->_row.find(colDef.id);
-  if (fit == pVC->_row.end()) {
-    sqlite3_result_null(ctx);
+  // tables that keep their own rows write directly
+
+  SqliteColumnResult result(ctx);
+  if (!pVC->_source && pVC->_pvt->_implementation->writeColumn(pVC->_context, (size_t)col, result)) {
     return SQLITE_OK;
   }
-  DynVal &val = fit->second;
+
+  // slot first, then values from legacy next()
+
+  DynVal *pval = pVC->_row.get(col);
+
+  // compute lazy column on first read of this row
+
+  if (nullptr == pval && (colDef.options & LAZY) && pVC->_row.find(colDef.id) == nullptr) {
+    DynVal lazyval;
+    if (pVC->_pvt->_implementation->getColumnValue(pVC->_context, pVC->_row, colDef.id, lazyval)) {
+      pVC->_row.at(col) = lazyval;
+      pval = pVC->_row.get(col);
+    }
+  }
+
+  if (nullptr == pval) {
+    auto fit = pVC->_row.legacy().find(colDef.id);
+    if (fit == pVC->_row.legacy().end()) {
+      sqlite3_result_null(ctx);
+      return SQLITE_OK;
+    }
+    pval = &fit->second;
+  }
+  DynVal &val = *pval;
 
   switch(val.type()) {
     case TSTRING:
@@ -492,7 +2015,7 @@ static int xColumn(sqlite3_vtab_cursor* psvCur, sqlite3_context* ctx, int col) {
 static int xEof(sqlite3_vtab_cursor* psvCur) {
   auto pVC = (my_vtab_cursor*)psvCur;
 
-  return pVC->_row.empty();
+  return pVC->_eof;
 }
 
 //----------------------------------------------------------------------
@@ -500,7 +2023,16 @@ static int xEof(sqlite3_vtab_cursor* psvCur) {
 //----------------------------------------------------------------------
 int xClose(sqlite3_vtab_cursor* psvCur) {
   auto pVC = (my_vtab_cursor*)psvCur;
-  //plan("Closing cursor (" + std::to_string(pCur->id) + ")");
+  stopSource(pVC);
+  releaseContext(pVC);
+  if (pVC->_prefetch) {
+    pVC->_prefetch->cancel();
+  }
+  if (pVC->_statement != nullptr) {
+    auto &cursors = pVC->_statement->_cursors;
+    cursors.erase(std::remove(cursors.begin(), cursors.end(), pVC), cursors.end());
+  }
+
   delete pVC;
   return SQLITE_OK;
 }
@@ -550,6 +2082,10 @@ static sqlite3_module *getReadOnlyTableModule() {
   return &_module;
 }
 
+std::shared_ptr<void> VSQLiteImpl::_beginStatement() {
+  return std::make_shared<RunningStatement>(_statements);
+}
+
 void VSQLiteImpl::remove(SPVirtualTable spVirtualTable) {
   // remove from _tables list
 
@@ -661,6 +2197,13 @@ std::string createStatement(const TableDef &td) {
 }
 
 
+//----------------------------------------------------------------
+// called by sqlite when the module is dropped
+//----------------------------------------------------------------
+static void freeModuleAux(void *pAux) {
+  delete (module_aux_t*)pAux;
+}
+
 //----------------------------------------------------------------
 // Add table
 //----------------------------------------------------------------
@@ -679,8 +2222,9 @@ int VSQLiteImpl::add(SPVirtualTable spVirtualTable) {
 
   auto &tableDef = spVirtualTable->getTableDef();
   auto tableName = tableDef.schemaId->name;
-  int rc = sqlite3_create_module(
-      _db, tableName.c_str(), getReadOnlyTableModule(), (void*)spVirtualTable.get());
+  int rc = sqlite3_create_module_v2(
+      _db, tableName.c_str(), getReadOnlyTableModule(),
+      new module_aux_t { spVirtualTable.get(), this }, freeModuleAux);
 
   if (rc == SQLITE_OK || rc == SQLITE_MISUSE) {
     auto sql =
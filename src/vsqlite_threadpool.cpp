@@ -0,0 +1,56 @@
+#include "vsqlite_threadpool.h"
+
+#include <algorithm>
+
+namespace vsqlite {
+
+ThreadPool::ThreadPool(size_t numThreads) {
+  for (size_t i=0; i < std::max<size_t>(1, numThreads); i++) {
+    _threads.emplace_back(&ThreadPool::run, this);
+  }
+}
+
+//----------------------------------------------------------------------
+// queued tasks are run before the threads exit
+//----------------------------------------------------------------------
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _cv.notify_all();
+  for (auto &t : _threads) {
+    t.join();
+  }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tasks.push_back(std::move(task));
+  }
+  _cv.notify_one();
+}
+
+void ThreadPool::run() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+      if (_tasks.empty()) {
+        return;
+      }
+      task = std::move(_tasks.front());
+      _tasks.pop_front();
+    }
+    task();
+  }
+}
+
+ThreadPool &ThreadPool::shared() {
+  static ThreadPool pool(std::max<size_t>(2, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+} // namespace vsqlite
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vsqlite {
+
+/*
+ * Fixed set of worker threads shared by all tables, for work that
+ * is fanned out from a single cursor (see PARALLEL_LOOKUP).
+ * Tasks must not wait on other tasks.
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t numThreads);
+  ~ThreadPool();
+
+  void submit(std::function<void()> task);
+
+  size_t size() const { return _threads.size(); }
+
+  /*
+   * The process-wide pool, one thread per core (at least two).
+   */
+  static ThreadPool &shared();
+
+private:
+  void run();
+
+  std::vector<std::thread> _threads;
+  std::deque<std::function<void()> > _tasks;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _stopping {false};
+};
+
+} // namespace vsqlite
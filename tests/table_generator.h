@@ -0,0 +1,59 @@
+#include "../include/vsqlite/generator_table.h"
+
+// A GeneratorTable ("tgen") of (a, b) pairs, 1 <= b <= a <= numRows,
+// produced one row at a time from nested loops.
+
+struct TGenState : public vsqlite::GeneratorState {
+  uint32_t first;
+  uint32_t last;
+  uint32_t a;
+  uint32_t b;
+};
+
+class TGeneratorTable : public vsqlite::GeneratorTable<TGenState> {
+public:
+  TGeneratorTable(uint32_t numRows) : _def(), _numRows(numRows) {
+    _def.schemaId = std::make_shared<SchemaId>("tgen");
+    _def.columns = {
+      {FA, vsqlite::ColOpt::INDEXED, ""}
+      ,{FB, 0, ""}
+    };
+  }
+  virtual ~TGeneratorTable() {}
+
+  const SPFieldDef FA = FieldDef::alloc(TUINT32, "a");
+  const SPFieldDef FB = FieldDef::alloc(TUINT32, "b");
+
+  const vsqlite::TableDef &getTableDef() const override {
+    return _def;
+  }
+
+  void start(vsqlite::SPQueryContext context, TGenState &gen) override {
+    gen.first = 1;
+    gen.last = _numRows;
+    const vsqlite::Constraint *pA = context->findConstraint(FA, vsqlite::OP_EQ);
+    if (nullptr != pA) {
+      gen.first = gen.last = pA->value;
+    }
+  }
+
+  bool generate(vsqlite::SPQueryContext context, TGenState &gen, vsqlite::Row &row) override {
+    _num_generate_calls++;
+
+    VSQLITE_GEN_BEGIN(gen);
+    for (gen.a = gen.first; gen.a <= gen.last; gen.a++) {
+      for (gen.b = 1; gen.b <= gen.a; gen.b++) {
+        row[FA] = gen.a;
+        row[FB] = gen.b;
+        VSQLITE_GEN_YIELD(gen);
+      }
+    }
+    VSQLITE_GEN_END(gen);
+  }
+
+  uint32_t _num_generate_calls {0};
+
+private:
+  vsqlite::TableDef _def;
+  uint32_t _numRows;
+};
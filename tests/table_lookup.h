@@ -0,0 +1,117 @@
+#include "../include/vsqlite/vsqlite.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// A test table ("tlookup") of (key, val) rows where val = key * 2,
+// standing in for a table whose lookups are slow (reading and
+// hashing a file).  Safe to call from several threads at once.
+
+class TLookupTable : public vsqlite::VirtualTable {
+public:
+  struct MyState {
+    std::vector<uint32_t> _keys;
+    size_t _idx;
+
+    void reset() {
+      _keys.clear();
+      _idx = 0;
+    }
+  };
+
+  TLookupTable(std::string name, uint32_t numRows, int lookupMillis, std::vector<std::string> tableAttrs)
+      : _def(), _numRows(numRows), _lookupMillis(lookupMillis) {
+    _def.schemaId = std::make_shared<SchemaId>(name);
+    _def.columns = {
+      {FKEY, vsqlite::ColOpt::INDEXED | vsqlite::ColOpt::UNIQUE, ""}
+      ,{FVAL, 0, ""}
+    };
+    _def.table_attrs = tableAttrs;
+    _def.estimatedRows = numRows;
+  }
+  virtual ~TLookupTable() {}
+
+  const SPFieldDef FKEY = FieldDef::alloc(TUINT32, "key");
+  const SPFieldDef FVAL = FieldDef::alloc(TUINT32, "val");
+
+  const vsqlite::TableDef &getTableDef() const override {
+    return _def;
+  }
+
+  void prepare(vsqlite::SPQueryContext context) override {
+    _num_prepare_calls++;
+    MyState &state = context->state<MyState>();
+
+    int active = ++_active;
+    int maxActive = _max_active.load();
+    while (active > maxActive && !_max_active.compare_exchange_weak(maxActive, active)) {}
+
+    bool indexed = false;
+    for (auto &constraint : context->getConstraintSpan()) {
+      if (constraint.columnId == FKEY && constraint.op == vsqlite::OP_EQ) {
+        indexed = true;
+        uint32_t key = constraint.value;
+        if (key > 0 && key <= _numRows) {
+          state._keys.push_back(key);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(_lookupMillis));
+      }
+    }
+    if (!indexed) {
+      for (uint32_t key = 1; key <= _numRows; key++) {
+        state._keys.push_back(key);
+      }
+    }
+
+    --_active;
+  }
+
+  bool nextRow(vsqlite::SPQueryContext context, vsqlite::Row &row) override {
+    MyState &state = context->state<MyState>();
+    if (state._idx >= state._keys.size()) {
+      return false;
+    }
+    uint32_t key = state._keys[state._idx++];
+    row[FKEY] = key;
+    row[FVAL] = key * 2;
+    return true;
+  }
+
+  bool lookupBatch(vsqlite::SPQueryContext context, const SPFieldDef &columnId,
+                   const std::vector<DynVal> &keys, vsqlite::BatchRows &rows) override {
+    if (columnId != FKEY) {
+      return false;
+    }
+    _num_batch_calls++;
+    _max_batch_keys = std::max<size_t>(_max_batch_keys, keys.size());
+
+    for (size_t i=0; i < keys.size(); i++) {
+      int64_t key = keys[i].as_i64();
+      if (key > 0 && key <= _numRows) {
+        vsqlite::Row &row = rows.addRow(i);
+        row[FKEY] = (uint32_t)key;
+        row[FVAL] = (uint32_t)key * 2;
+      }
+    }
+    return true;
+  }
+
+  void reset() {
+    _num_prepare_calls = 0;
+    _max_active = 0;
+    _num_batch_calls = 0;
+    _max_batch_keys = 0;
+  }
+
+  std::atomic<uint32_t> _num_prepare_calls {0};
+  uint32_t _num_batch_calls {0};
+  size_t _max_batch_keys {0};  // most keys passed to one lookupBatch()
+  std::atomic<int> _active {0};
+  std::atomic<int> _max_active {0};  // most prepare() calls running at once
+
+private:
+  vsqlite::TableDef _def;
+  uint32_t _numRows;
+  int _lookupMillis;
+};
@@ -0,0 +1,143 @@
+#include "../include/vsqlite/vsqlite.h"
+#include <algorithm>
+#include <set>
+#include <thread>
+
+// A configurable test table of (id, val) rows where val = id * 10.
+// Used by planner tests that need several tables with different sizes.
+
+class TNumbersTable : public vsqlite::VirtualTable {
+public:
+  struct MyState {
+    std::vector<uint32_t> _ids;
+    size_t _idx;
+
+    void reset() {
+      _ids.clear();
+      _idx = 0;
+    }
+  };
+
+  TNumbersTable(std::string name, uint32_t numRows, int64_t estimatedRows, bool exactId = false, uint32_t extraIdOptions = 0) : _def(), _numRows(numRows) {
+    _def.schemaId = std::make_shared<SchemaId>(name);
+    _def.columns = {
+      {FID, vsqlite::ColOpt::INDEXED | vsqlite::ColOpt::UNIQUE | extraIdOptions, ""}
+      ,{FVAL, 0, ""}
+    };
+    if (exactId) {
+      _def.columns[0].exactOps = { vsqlite::OP_EQ };
+    }
+    _def.estimatedRows = estimatedRows;
+    _def.orderings = { { {FID, false} } }; // ids are generated in order
+  }
+  virtual ~TNumbersTable() {}
+
+  const SPFieldDef FID = FieldDef::alloc(TUINT32, "id");
+  const SPFieldDef FVAL = FieldDef::alloc(TUINT32, "val");
+
+  const vsqlite::TableDef &getTableDef() const override {
+    return _def;
+  }
+
+  void estimate(const std::vector<vsqlite::IndexConstraint> &constraints, vsqlite::IndexEstimate &est) const override {
+    _num_estimate_calls++;
+  }
+
+  // allow tests to adjust the definition before the table is added
+  vsqlite::TableDef &tableDef() { return _def; }
+  vsqlite::ColumnDef &idColumn() { return _def.columns[0]; }
+
+  void prepare(vsqlite::SPQueryContext context) override {
+    _num_prepare_calls++;
+    _last_thread = std::this_thread::get_id();
+    static thread_local uint32_t tlPrepares = 0;
+    _max_thread_prepares = std::max(_max_thread_prepares, ++tlPrepares);
+    _last_ordering = context->getOrderingIndex();
+    _last_limit = context->getRowLimitHint();
+    _last_row_needed = context->isRowNeeded();
+
+    MyState &state = context->state<MyState>();
+    _state_ptrs.insert(&state);
+
+    _last_constraints = context->getConstraints();
+
+    bool indexed = false;
+    for (auto &constraint : context->getConstraintSpan()) {
+      if (constraint.columnId == FID && constraint.op == vsqlite::OP_EQ) {
+        indexed = true;
+        int64_t id = constraint.value.as_i64();
+        if (id > 0 && id <= _numRows) {
+          state._ids.push_back((uint32_t)id);
+        }
+        _num_index_constraints++;
+      }
+    }
+
+    // range constraints narrow the scan
+
+    uint32_t first = 1, last = _numRows;
+    _last_range_valid = context->getRange(FID, _last_range);
+    if (_last_range_valid) {
+      if (_last_range.lower.valid()) {
+        first = std::max<int64_t>(first, _last_range.lower.as_i64() + (_last_range.lowerInclusive ? 0 : 1));
+      }
+      if (_last_range.upper.valid()) {
+        last = std::min<int64_t>(last, _last_range.upper.as_i64() - (_last_range.upperInclusive ? 0 : 1));
+      }
+    }
+
+    if (!indexed) {
+      for (uint32_t id = first; id <= last; id++) {
+        state._ids.push_back(id);
+      }
+    }
+  }
+
+  bool nextRow(vsqlite::SPQueryContext context, vsqlite::Row &row) override {
+    _num_next_calls++;
+
+    MyState &state = context->state<MyState>();
+
+    if (state._idx < state._ids.size()) {
+      uint32_t id = state._ids[state._idx++];
+      if (context->isCountOnly()) {
+        _num_count_only_rows++;
+        return true;
+      }
+      row[FID] = id;
+      row[FVAL] = id * 10;
+      return true;
+    }
+
+    return false;
+  }
+
+  void reset() {
+    _num_next_calls = 0;
+    _num_prepare_calls = 0;
+    _num_index_constraints = 0;
+    _num_estimate_calls = 0;
+    _num_count_only_rows = 0;
+    _max_thread_prepares = 0;
+    _state_ptrs.clear();
+  }
+
+  uint32_t _num_prepare_calls {0};
+  uint32_t _num_next_calls {0};
+  uint32_t _num_index_constraints {0};
+  mutable uint32_t _num_estimate_calls {0};
+  uint32_t _num_count_only_rows {0};
+  std::thread::id _last_thread;
+  uint32_t _max_thread_prepares {0};  // most prepare() calls seen by one thread
+  int _last_ordering {-1};
+  int64_t _last_limit {-1};
+  bool _last_row_needed {true};
+  bool _last_range_valid {false};
+  vsqlite::ColumnRange _last_range;
+  std::vector<vsqlite::Constraint> _last_constraints;
+  std::set<const MyState*> _state_ptrs;
+
+private:
+  vsqlite::TableDef _def;
+  uint32_t _numRows;
+};
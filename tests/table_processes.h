@@ -17,10 +17,16 @@ public:
   };
 
   std::map<uint32_t,RawData> _indexedData;
-  TProcessTable() {
+  TProcessTable(std::string name = "tprocess", std::vector<std::string> tableAttrs = {}) : _def() {
     for (auto &item : getRawData()) {
       _indexedData[item.pid] = item;
     }
+    _def.schemaId = std::make_shared<SchemaId>(name);
+    _def.columns = {
+      {FPID, vsqlite::ColOpt::INDEXED, ""}
+      ,{FPATH, 0, ""}
+    };
+    _def.table_attrs = tableAttrs;
   }
   virtual ~TProcessTable() {}
 
@@ -28,15 +34,7 @@ public:
   const SPFieldDef FPID = FieldDef::alloc(TINT32, "pid");
 
   const vsqlite::TableDef &getTableDef() const override {
-    static const vsqlite::TableDef def = {
-       std::make_shared<SchemaId>("tprocess"),
-      {
-        {FPID, vsqlite::ColOpt::INDEXED, ""}
-        ,{FPATH, 0, ""}
-      },
-      { } // table_attrs
-    };
-    return def;
+    return _def;
   }
 
   /**
@@ -44,19 +42,18 @@ public:
   void prepare(vsqlite::SPQueryContext context) override {
     _num_prepare_calls++;
 
-    // make state
-    
-    auto spState = std::make_shared<MyState>();
-    context->setUserData(spState);
+    // reuse state, reset for this prepare()
 
-    if (context->getConstraints().empty()) {
+    MyState &state = context->state<MyState>();
+
+    if (context->getConstraintSpan().empty()) {
       for (auto &item : getRawData()) {
-        spState->_data.push_back(item);
+        state._data.push_back(item);
       }
     } else {
       // gather index constraints for filtering data
 
-      for (auto constraint : context->getConstraints()) {
+      for (auto &constraint : context->getConstraintSpan()) {
 
         if (constraint.columnId == FPID && constraint.op == vsqlite::OP_EQ) {
 
@@ -64,7 +61,7 @@ public:
 
           auto fit = _indexedData.find(pid);
           if (fit != _indexedData.end()) {
-            spState->_data.push_back(fit->second);
+            state._data.push_back(fit->second);
           }
 
           _num_index_constraints++;
@@ -76,10 +73,10 @@ public:
   bool next(vsqlite::SPQueryContext context, DynMap &row) override {
     _num_next_calls++;
 
-    std::shared_ptr<MyState> spState = std::static_pointer_cast<MyState>(context->getUserData());
+    MyState &state = context->state<MyState>();
 
-    if (spState->_idx < spState->_data.size()) {
-      auto &item = spState->_data[spState->_idx++];
+    if (state._idx < state._data.size()) {
+      auto &item = state._data[state._idx++];
       row[FPATH] = item.path;
       row[FPID] = item.pid;
       return true;
@@ -110,5 +107,8 @@ public:
   uint32_t _num_prepare_calls {0};
   uint32_t _num_next_calls {0};
   uint32_t _num_index_constraints {0};
+
+private:
+  vsqlite::TableDef _def;
 };
 
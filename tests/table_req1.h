@@ -53,7 +53,7 @@ public:
     // each LIKE term and you return multiple results.  It's also a best-effort
     // case rather than OP_EQ, which should be exact lookup.
 
-    for (auto constraint : context->getConstraints()) {
+    for (auto &constraint : context->getConstraintSpan()) {
 
       if (constraint.columnId == FPATH && constraint.op == vsqlite::OP_EQ) {
 
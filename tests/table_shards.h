@@ -0,0 +1,123 @@
+#include "../include/vsqlite/vsqlite.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+
+// A test table ("tshards") of (key, val) rows where val = key * 2,
+// split into shards of consecutive keys that can be scanned as
+// partitions.  Safe to call from several threads at once.
+
+class TShardsTable : public vsqlite::VirtualTable {
+public:
+  struct MyState {
+    uint32_t _next {1};
+    uint32_t _last {0};
+
+    void reset() {
+      _next = 1;
+      _last = 0;
+    }
+  };
+
+  TShardsTable(std::string name, uint32_t numShards, uint32_t rowsPerShard, int scanMillis, std::vector<std::string> tableAttrs)
+      : _def(), _numShards(numShards), _rowsPerShard(rowsPerShard), _scanMillis(scanMillis) {
+    _def.schemaId = std::make_shared<SchemaId>(name);
+    _def.columns = {
+      {FKEY, vsqlite::ColOpt::INDEXED | vsqlite::ColOpt::UNIQUE, ""}
+      ,{FVAL, 0, ""}
+    };
+    _def.table_attrs = tableAttrs;
+    _def.estimatedRows = numShards * rowsPerShard;
+    _def.orderings = { { {FKEY, false} } }; // shards are in key order
+  }
+  virtual ~TShardsTable() {}
+
+  const SPFieldDef FKEY = FieldDef::alloc(TUINT32, "key");
+  const SPFieldDef FVAL = FieldDef::alloc(TUINT32, "val");
+
+  const vsqlite::TableDef &getTableDef() const override {
+    return _def;
+  }
+
+  size_t getPartitionCount(vsqlite::SPQueryContext context) override {
+    if (context->findConstraint(FKEY, vsqlite::OP_EQ) != nullptr) {
+      return 0;
+    }
+    return _numShards;
+  }
+
+  void prepare(vsqlite::SPQueryContext context) override {
+    _num_prepare_calls++;
+    MyState &state = context->state<MyState>();
+    {
+      std::lock_guard<std::mutex> lock(_threadsMutex);
+      _threads.insert(std::this_thread::get_id());
+    }
+
+    int active = ++_active;
+    int maxActive = _max_active.load();
+    while (active > maxActive && !_max_active.compare_exchange_weak(maxActive, active)) {}
+
+    const vsqlite::Constraint *pKey = context->findConstraint(FKEY, vsqlite::OP_EQ);
+    int partition = context->getPartition();
+    if (pKey != nullptr) {
+      state._next = pKey->value;
+      state._last = std::min<uint32_t>(state._next, _numShards * _rowsPerShard);
+    } else if (partition >= 0) {
+      state._next = partition * _rowsPerShard + 1;
+      state._last = (partition + 1) * _rowsPerShard;
+      _num_partitions++;
+    } else {
+      state._last = _numShards * _rowsPerShard;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(_scanMillis));
+
+    --_active;
+  }
+
+  bool nextRow(vsqlite::SPQueryContext context, vsqlite::Row &row) override {
+    MyState &state = context->state<MyState>();
+    if (state._next > state._last) {
+      return false;
+    }
+    uint32_t key = state._next++;
+    row[FKEY] = key;
+    row[FVAL] = key * 2;
+    return true;
+  }
+
+  void reset() {
+    _num_prepare_calls = 0;
+    _num_partitions = 0;
+    _max_active = 0;
+    std::lock_guard<std::mutex> lock(_threadsMutex);
+    _threads.clear();
+  }
+
+  // true if prepare() ran on a thread other than the caller's
+  bool preparedElsewhere() {
+    std::lock_guard<std::mutex> lock(_threadsMutex);
+    for (auto &id : _threads) {
+      if (id != std::this_thread::get_id()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::atomic<uint32_t> _num_prepare_calls {0};
+  std::atomic<uint32_t> _num_partitions {0};  // prepare() calls with getPartition() >= 0
+  std::atomic<int> _active {0};
+  std::atomic<int> _max_active {0};  // most prepare() calls running at once
+
+private:
+  std::mutex _threadsMutex;
+  std::set<std::thread::id> _threads;  // threads prepare() ran on
+
+  vsqlite::TableDef _def;
+  uint32_t _numShards;
+  uint32_t _rowsPerShard;
+  int _scanMillis;
+};
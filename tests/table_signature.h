@@ -19,10 +19,18 @@ public:
   };
 
   std::map<std::string,RawData> _indexedData;
-  TSignatureTable() {
+  TSignatureTable(std::string name = "tsig", std::vector<std::string> tableAttrs = {}) : _def() {
     for (auto &item : getRawData()) {
       _indexedData[item.path] = item;
     }
+    _def.schemaId = std::make_shared<SchemaId>(name);
+    _def.columns = {
+      {FPATH, vsqlite::ColOpt::REQUIRED, "",0,{vsqlite::OP_EQ, vsqlite::OP_LIKE }}
+      ,{FSIGNED, 0, ""}
+      ,{FCDHASH, 0, ""}
+      ,{FIDENTIFIER, 0, ""}
+    };
+    _def.table_attrs = tableAttrs;
   }
   virtual ~TSignatureTable() {}
 
@@ -33,17 +41,7 @@ public:
   const SPFieldDef FIDENTIFIER = FieldDef::alloc(TSTRING, "identifier");
 
   const vsqlite::TableDef &getTableDef() const override {
-    static const vsqlite::TableDef def = {
-       std::make_shared<SchemaId>("tsig"),
-      {
-        {FPATH, vsqlite::ColOpt::REQUIRED, "",0,{vsqlite::OP_EQ, vsqlite::OP_LIKE }}
-        ,{FSIGNED, 0, ""}
-        ,{FCDHASH, 0, ""}
-        ,{FIDENTIFIER, 0, ""}
-      },
-      { } // table_attrs
-    };
-    return def;
+    return _def;
   }
 
   /**
@@ -59,7 +57,7 @@ public:
     // gather index constraints for filtering data
     // path is REQUIRED
 
-    for (auto constraint : context->getConstraints()) {
+    for (auto &constraint : context->getConstraintSpan()) {
 
       if (constraint.columnId == FPATH && constraint.op == vsqlite::OP_EQ) {
 
@@ -107,10 +105,38 @@ public:
     return false;
   }
 
+  /**
+   * one call for all paths of a join, when table_attrs has BATCH_LOOKUP
+   */
+  bool lookupBatch(vsqlite::SPQueryContext context, const SPFieldDef &columnId,
+                   const std::vector<DynVal> &keys, vsqlite::BatchRows &rows) override {
+    if (columnId != FPATH) {
+      return false;
+    }
+    _num_batch_calls++;
+    _num_batch_keys += keys.size();
+
+    for (size_t i=0; i < keys.size(); i++) {
+      auto fit = _indexedData.find(keys[i].as_s());
+      if (fit == _indexedData.end()) {
+        continue;
+      }
+      auto &item = fit->second;
+      vsqlite::Row &row = rows.addRow(i);
+      row[FPATH] = item.path;
+      row[FSIGNED] = item.issigned;
+      row[FIDENTIFIER] = item.identifier;
+      row[FCDHASH] = item.cdhash;
+    }
+    return true;
+  }
+
   void reset() {
     _num_next_calls = 0;
     _num_prepare_calls = 0;
     _num_index_constraints = 0;
+    _num_batch_calls = 0;
+    _num_batch_keys = 0;
   }
 
   static const std::vector<RawData> &getRawData() {
@@ -131,5 +157,10 @@ public:
   uint32_t _num_prepare_calls {0};
   uint32_t _num_next_calls {0};
   uint32_t _num_index_constraints {0};
+  uint32_t _num_batch_calls {0};
+  uint32_t _num_batch_keys {0};
+
+private:
+  vsqlite::TableDef _def;
 };
 
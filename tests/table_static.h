@@ -0,0 +1,68 @@
+#include "../include/vsqlite/static_table.h"
+
+// A StaticTable ("tstatic") over a plain struct.
+
+struct StaticFileRow {
+  uint32_t uid;
+  std::string path;
+  int64_t size;
+  double ratio;
+};
+
+class TStaticFilesTable : public vsqlite::StaticTable<StaticFileRow,
+    VSQLITE_FIELD(StaticFileRow, uid),
+    VSQLITE_FIELD(StaticFileRow, path),
+    VSQLITE_FIELD(StaticFileRow, size),
+    VSQLITE_FIELD(StaticFileRow, ratio)> {
+public:
+  TStaticFilesTable(const std::string &name = "tstatic", const std::vector<std::string> &attrs = {},
+                    const std::vector<StaticFileRow> &data = getRawData())
+    : StaticTable(name, {
+      {"uid", vsqlite::ColOpt::INDEXED, "user id"}
+      ,{"path"}
+      ,{"size"}
+      ,{"ratio"}
+    }), _data(data) {
+    _def.table_attrs = attrs;
+  }
+
+  void generate(vsqlite::SPQueryContext context, std::vector<StaticFileRow> &rows) override {
+    _num_generate_calls++;
+
+    const vsqlite::Constraint *pUid = context->findConstraint(field(0), vsqlite::OP_EQ);
+    for (auto &item : _data) {
+      if (nullptr == pUid || (uint32_t)pUid->value == item.uid) {
+        rows.push_back(item);
+      }
+    }
+  }
+
+  static const std::vector<StaticFileRow> &getRawData() {
+    static const std::vector<StaticFileRow> _gRawData {
+      // uid, path, size, ratio
+      {0, "/etc/passwd", 1024, 0.5}
+      ,{0, "/etc/hosts", 256, 0.25}
+      ,{501, "/home/bob/.profile", 88, 1.5}
+    };
+    return _gRawData;
+  }
+
+  uint32_t _num_generate_calls {0};
+
+private:
+  std::vector<StaticFileRow> _data;
+};
+
+// Declares fewer column specs than fields, add() must fail.
+
+class TBadSpecsTable : public vsqlite::StaticTable<StaticFileRow,
+    VSQLITE_FIELD(StaticFileRow, uid),
+    VSQLITE_FIELD(StaticFileRow, path),
+    VSQLITE_FIELD(StaticFileRow, size)> {
+public:
+  TBadSpecsTable() : StaticTable("tstatic_bad", { {"uid"}, {"path"} }) {}
+
+  void generate(vsqlite::SPQueryContext context, std::vector<StaticFileRow> &rows) override {
+    rows = TStaticFilesTable::getRawData();
+  }
+};
@@ -0,0 +1,133 @@
+#include "../include/vsqlite/vsqlite.h"
+
+// A test table ("tuserfiles") with a composite (uid, path) index.
+// Neither column can be looked up on its own.  The 'hash' column
+// is LAZY, computed only when read.
+
+class TUserFilesTable : public vsqlite::VirtualTable {
+public:
+  struct RawData {
+    uint32_t uid;
+    std::string path;
+    int64_t size;
+  };
+
+  struct MyState {
+    std::vector<RawData> _data;
+    size_t _idx;
+  };
+
+  std::map<std::pair<uint32_t,std::string>,RawData> _indexedData;
+  TUserFilesTable() {
+    for (auto &item : getRawData()) {
+      _indexedData[std::make_pair(item.uid, item.path)] = item;
+    }
+  }
+  virtual ~TUserFilesTable() {}
+
+  const SPFieldDef FUID = FieldDef::alloc(TUINT32, "uid");
+  const SPFieldDef FPATH = FieldDef::alloc(TSTRING, "path");
+  const SPFieldDef FSIZE = FieldDef::alloc(TINT64, "size");
+  const SPFieldDef FHASH = FieldDef::alloc(TSTRING, "hash");
+
+  const vsqlite::TableDef &getTableDef() const override {
+    static const vsqlite::TableDef def = {
+       std::make_shared<SchemaId>("tuserfiles"),
+      {
+        {FUID, 0, ""}
+        ,{FPATH, 0, ""}
+        ,{FSIZE, 0, ""}
+        ,{FHASH, vsqlite::ColOpt::LAZY, "expensive, computed on read"}
+      },
+      { }, // table_attrs
+      1000, // estimatedRows
+      { }, // orderings
+      {
+        {{FUID, FPATH}, vsqlite::ColOpt::UNIQUE, 0}
+      }
+    };
+    return def;
+  }
+
+  void prepare(vsqlite::SPQueryContext context) override {
+    _num_prepare_calls++;
+    _last_index = context->getIndexIndex();
+
+    auto spState = std::make_shared<MyState>();
+    context->setUserData(spState);
+
+    if (_last_index != 0) {
+      spState->_data = getRawData();
+      return;
+    }
+
+    // the index needs both
+
+    const vsqlite::Constraint *pUid = context->findConstraint(FUID, vsqlite::OP_EQ);
+    const vsqlite::Constraint *pPath = context->findConstraint(FPATH, vsqlite::OP_EQ);
+    if (nullptr == pUid || nullptr == pPath) {
+      return;
+    }
+    uint32_t uid = pUid->value;
+    std::string path = pPath->value.as_s();
+    _num_index_constraints += 2;
+
+    auto fit = _indexedData.find(std::make_pair(uid, path));
+    if (fit != _indexedData.end()) {
+      spState->_data.push_back(fit->second);
+    }
+  }
+
+  bool next(vsqlite::SPQueryContext context, DynMap &row) override {
+    _num_next_calls++;
+
+    std::shared_ptr<MyState> spState = std::static_pointer_cast<MyState>(context->getUserData());
+
+    if (spState->_idx < spState->_data.size()) {
+      auto &item = spState->_data[spState->_idx++];
+      row[FUID] = item.uid;
+      row[FPATH] = item.path;
+      row[FSIZE] = item.size;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool getColumnValue(vsqlite::SPQueryContext context, const vsqlite::Row &row, const SPFieldDef &columnId, DynVal &value) override {
+    const DynVal *pPath = row.find(FPATH);
+    if (columnId != FHASH || nullptr == pPath) {
+      return false;
+    }
+    _num_hash_calls++;
+    value = "hash:" + pPath->as_s();
+    return true;
+  }
+
+  void reset() {
+    _num_next_calls = 0;
+    _num_prepare_calls = 0;
+    _num_index_constraints = 0;
+    _last_index = -1;
+    _num_hash_calls = 0;
+  }
+
+  static const std::vector<RawData> &getRawData() {
+
+    static const std::vector<RawData> _gRawData {
+      // uid, path, size
+      {0, "/etc/passwd", 1024}
+      ,{0, "/etc/hosts", 256}
+      ,{501, "/etc/hosts", 300}
+      ,{501, "/home/bob/.profile", 88}
+      ,{502, "/home/alice/.profile", 92}
+    };
+    return _gRawData;
+  }
+
+  uint32_t _num_prepare_calls {0};
+  uint32_t _num_next_calls {0};
+  uint32_t _num_index_constraints {0};
+  int _last_index {-1};
+  uint32_t _num_hash_calls {0};
+};
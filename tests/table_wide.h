@@ -0,0 +1,49 @@
+#include "../include/vsqlite/vsqlite.h"
+
+// A table with more columns than fit in sqlite's 64-bit colUsed mask.
+// Column cN of row r has value r * 1000 + N, except c2 is NULL on odd rows.
+
+class TWideTable : public vsqlite::VirtualTable {
+public:
+  TWideTable(uint32_t numColumns, uint32_t numRows) : _def(), _numRows(numRows) {
+    _def.schemaId = std::make_shared<SchemaId>("twide");
+    for (uint32_t i=0; i < numColumns; i++) {
+      _fields.push_back(FieldDef::alloc(TUINT32, "c" + std::to_string(i)));
+      _def.columns.push_back({_fields.back(), 0, ""});
+    }
+  }
+  virtual ~TWideTable() {}
+
+  const vsqlite::TableDef &getTableDef() const override {
+    return _def;
+  }
+
+  void prepare(vsqlite::SPQueryContext context) override {
+    _last_requested = context->getRequestedColumnBits();
+    _rowIdx = 0;
+  }
+
+  bool nextRow(vsqlite::SPQueryContext context, vsqlite::Row &row) override {
+    if (_rowIdx >= _numRows) {
+      return false;
+    }
+    for (size_t i=0; i < _fields.size(); i++) {
+      if (i == 2 && (_rowIdx % 2) == 1) {
+        continue;
+      }
+      if (_last_requested.test(i)) {
+        row.at(i) = (uint32_t)(_rowIdx * 1000 + i);
+      }
+    }
+    _rowIdx++;
+    return true;
+  }
+
+  vsqlite::ColumnBitmap _last_requested;
+
+private:
+  vsqlite::TableDef _def;
+  std::vector<SPFieldDef> _fields;
+  uint32_t _numRows;
+  uint32_t _rowIdx {0};
+};
@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "table_generator.h"
+
+static uint32_t gCount = 0;
+static std::shared_ptr<TGeneratorTable> spTable;
+
+class GeneratorTableTest : public ::testing::Test {
+protected:
+  virtual void SetUp() override {
+
+    vsqlite = vsqlite::VSQLiteInstance();
+
+    if (gCount++ == 0) {
+      spTable = std::make_shared<TGeneratorTable>(4);
+      int status = vsqlite->add(spTable);
+      ASSERT_EQ(0, status);
+    }
+    spTable->_num_generate_calls = 0;
+  }
+  virtual void TearDown() override {
+
+  }
+
+  vsqlite::SPVSQLite vsqlite;
+  vsqlite::SimpleQueryListener listener;
+
+};
+
+/*
+ * Rows resume inside nested loops.
+ */
+TEST_F(GeneratorTableTest, select_all) {
+  int rv = vsqlite->query("SELECT a, b FROM tgen", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1 + 2 + 3 + 4, listener.results.size());
+  EXPECT_EQ(1 + 2 + 3 + 4 + 1, spTable->_num_generate_calls);
+
+  auto FA = listener.columnForName("a");
+  auto FB = listener.columnForName("b");
+  EXPECT_EQ(1, (int)listener.results[0][FA]);
+  EXPECT_EQ(1, (int)listener.results[0][FB]);
+  EXPECT_EQ(3, (int)listener.results[5][FA]);
+  EXPECT_EQ(3, (int)listener.results[5][FB]);
+  EXPECT_EQ(4, (int)listener.results[9][FA]);
+  EXPECT_EQ(4, (int)listener.results[9][FB]);
+}
+
+/*
+ * Only rows sqlite reads are generated.
+ */
+TEST_F(GeneratorTableTest, limit) {
+  int rv = vsqlite->query("SELECT a, b FROM tgen LIMIT 2", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(2, listener.results.size());
+  EXPECT_EQ(2, spTable->_num_generate_calls);
+}
+
+/*
+ * State restarts for each prepare().
+ */
+TEST_F(GeneratorTableTest, indexed) {
+  int rv = vsqlite->query("SELECT a, b FROM tgen WHERE a IN (2, 3)", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(2 + 3, listener.results.size());
+  EXPECT_EQ(3, (int)listener.results[4][listener.columnForName("a")]);
+}
@@ -192,3 +192,17 @@ TEST_F(IndexTest, sub_select_index_colsused) {
   
   EXPECT_EQ((T1Table::getRawData().size()), listener.results.size());
 }
+
+/*
+ * An alias column is requested whenever its aliased column is.
+ */
+TEST_F(IndexTest, alias_column_requested) {
+  int rv = vsqlite->query("SELECT dword FROM t1", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_TRUE(spTable->_alias_requested);
+  EXPECT_EQ(T1Table::getRawData().size(), listener.results.size());
+
+  rv = vsqlite->query("SELECT name FROM t1", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_FALSE(spTable->_alias_requested);
+}
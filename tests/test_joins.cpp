@@ -3,10 +3,17 @@
 
 #include "table_processes.h"
 #include "table_signature.h"
+#include "table_numbers.h"
+#include "table_lookup.h"
+#include <set>
 
 static uint32_t gCount = 0;
 static std::shared_ptr<TProcessTable> spProcessTable;
+static std::shared_ptr<TProcessTable> spPrefetchProcessTable;
 static std::shared_ptr<TSignatureTable> spSigTable;
+static std::shared_ptr<TSignatureTable> spBatchSigTable;
+static std::shared_ptr<TNumbersTable> spPrefetchNumbersTable;
+static std::shared_ptr<TLookupTable> spBatchLookupTable;
 
 class JoinTest : public ::testing::Test {
 protected:
@@ -19,12 +26,32 @@ protected:
       int status = vsqlite->add(spProcessTable);
       ASSERT_EQ(0, status);
 
+      spPrefetchProcessTable = std::make_shared<TProcessTable>("tprocess_pf", std::vector<std::string>{ "PREFETCH" });
+      status = vsqlite->add(spPrefetchProcessTable);
+      ASSERT_EQ(0, status);
+
       spSigTable = std::make_shared<TSignatureTable>();
       status = vsqlite->add(spSigTable);
       ASSERT_EQ(0, status);
+
+      spBatchSigTable = std::make_shared<TSignatureTable>("tsigbatch", std::vector<std::string>{ "BATCH_LOOKUP" });
+      status = vsqlite->add(spBatchSigTable);
+      ASSERT_EQ(0, status);
+
+      spPrefetchNumbersTable = std::make_shared<TNumbersTable>("tnumbers_pf", 1000, 1000);
+      spPrefetchNumbersTable->tableDef().table_attrs = { "PREFETCH" };
+      status = vsqlite->add(spPrefetchNumbersTable);
+      ASSERT_EQ(0, status);
+
+      spBatchLookupTable = std::make_shared<TLookupTable>("tlookup_batch", 1000, 0, std::vector<std::string>{ "BATCH_LOOKUP" });
+      status = vsqlite->add(spBatchLookupTable);
+      ASSERT_EQ(0, status);
     } else {
       spProcessTable->reset();
+      spPrefetchProcessTable->reset();
       spSigTable->reset();
+      spBatchSigTable->reset();
+      spBatchLookupTable->reset();
     }
   }
   virtual void TearDown() override {
@@ -83,3 +110,94 @@ TEST_F(JoinTest, not_select_in) {
   EXPECT_EQ(1, listener.results.size());
 }
 
+
+/*
+ * tsigbatch is BATCH_LOOKUP.  The join keys of tprocess_pf, a
+ * PREFETCH table, are collected first, and looked up with one
+ * lookupBatch() call instead of one prepare() per process.
+ */
+TEST_F(JoinTest, batch_lookup) {
+  int rv = vsqlite->query("SELECT * FROM tprocess_pf JOIN tsigbatch USING (path)", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, spPrefetchProcessTable->_num_prepare_calls);
+  ASSERT_EQ(TProcessTable::getRawData().size()+1, spPrefetchProcessTable->_num_next_calls);
+
+  EXPECT_EQ(0, spBatchSigTable->_num_prepare_calls);
+  EXPECT_EQ(1, spBatchSigTable->_num_batch_calls);
+
+  std::set<std::string> paths;
+  for (auto &item : TProcessTable::getRawData()) {
+    paths.insert(item.path);
+  }
+  EXPECT_EQ(paths.size(), spBatchSigTable->_num_batch_keys);
+
+  EXPECT_EQ(3, listener.results.size());
+}
+
+/*
+ * Same results as indexed_select_in, the IN list is checked
+ * by sqlite on the outer rows.
+ */
+TEST_F(JoinTest, batch_lookup_left_join) {
+  int rv = vsqlite->query("SELECT * FROM tprocess_pf LEFT JOIN tsigbatch USING (PATH) WHERE path IN ('/usr/bin/base64','/bin/ls','/usr/local/bin/exiftool')", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(0, spBatchSigTable->_num_prepare_calls);
+  EXPECT_EQ(1, spBatchSigTable->_num_batch_calls);
+  EXPECT_EQ(2, listener.results.size());
+}
+
+/*
+ * Lookups sqlite compares with another collation than BINARY
+ * are not batched, each calls prepare().
+ */
+TEST_F(JoinTest, batch_lookup_collation) {
+  int rv = vsqlite->query("SELECT * FROM tprocess_pf JOIN tsigbatch ON tsigbatch.path = tprocess_pf.path COLLATE NOCASE", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(TProcessTable::getRawData().size(), spBatchSigTable->_num_prepare_calls);
+  EXPECT_EQ(0, spBatchSigTable->_num_batch_calls);
+  EXPECT_EQ(3, listener.results.size());
+}
+
+/*
+ * Each lookupBatch() call gets a limited number of keys.
+ * Lookups past them load the next batch.
+ */
+TEST_F(JoinTest, batch_lookup_limited) {
+  int rv = vsqlite->query("SELECT a.id, b.val FROM tnumbers_pf a CROSS JOIN tlookup_batch b ON b.key = a.id", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1000, listener.results.size());
+  EXPECT_EQ(2000, (int)listener.results[999][listener.columnForName("val")]);
+  EXPECT_EQ(0, spBatchLookupTable->_num_prepare_calls);
+  EXPECT_EQ(4, spBatchLookupTable->_num_batch_calls);
+  EXPECT_EQ(256, spBatchLookupTable->_max_batch_keys);
+
+  listener.results.clear();
+  spBatchLookupTable->reset();
+  rv = vsqlite->query("SELECT a.id, b.val FROM tnumbers_pf a CROSS JOIN tlookup_batch b ON b.key = a.id LIMIT 5", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(5, listener.results.size());
+  EXPECT_EQ(1, spBatchLookupTable->_num_batch_calls);
+}
+
+/*
+ * An outer table without PREFETCH is not scanned ahead of
+ * sqlite, so its lookups call prepare().
+ */
+TEST_F(JoinTest, batch_lookup_needs_prefetch) {
+  int rv = vsqlite->query("SELECT * FROM tprocess JOIN tsigbatch USING (path)", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(TProcessTable::getRawData().size(), spBatchSigTable->_num_prepare_calls);
+  EXPECT_EQ(0, spBatchSigTable->_num_batch_calls);
+  EXPECT_EQ(3, listener.results.size());
+}
+
+/*
+ * A lookup not driven by a join still calls prepare().
+ */
+TEST_F(JoinTest, batch_lookup_direct) {
+  int rv = vsqlite->query("SELECT * FROM tsigbatch WHERE path = '/sbin/launchd'", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spBatchSigTable->_num_prepare_calls);
+  EXPECT_EQ(0, spBatchSigTable->_num_batch_calls);
+  EXPECT_EQ(1, listener.results.size());
+}
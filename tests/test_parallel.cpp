@@ -0,0 +1,196 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "table_lookup.h"
+#include "table_shards.h"
+#include <set>
+
+static uint32_t gCount = 0;
+static vsqlite::SPVSQLite gParallelDb;
+static std::shared_ptr<TLookupTable> spParallelTable;
+static std::shared_ptr<TLookupTable> spSerialTable;
+static std::shared_ptr<TShardsTable> spShardsTable;
+static std::shared_ptr<TShardsTable> spOrderedShardsTable;
+
+class ParallelTest : public ::testing::Test {
+protected:
+  virtual void SetUp() override {
+
+    if (gCount++ == 0) {
+      gParallelDb = vsqlite::VSQLiteNew();
+
+      spParallelTable = std::make_shared<TLookupTable>("tlookup", 100, 20, std::vector<std::string>{ "PARALLEL_LOOKUP" });
+      int status = gParallelDb->add(spParallelTable);
+      ASSERT_EQ(0, status);
+
+      spSerialTable = std::make_shared<TLookupTable>("tserial", 100, 20, std::vector<std::string>{ });
+      status = gParallelDb->add(spSerialTable);
+      ASSERT_EQ(0, status);
+
+      spShardsTable = std::make_shared<TShardsTable>("tshards", 4, 2500, 20, std::vector<std::string>{ "PARTITIONED" });
+      status = gParallelDb->add(spShardsTable);
+      ASSERT_EQ(0, status);
+
+      spOrderedShardsTable = std::make_shared<TShardsTable>("tshards_ordered", 4, 2500, 20, std::vector<std::string>{ "PARTITIONED_ORDERED" });
+      status = gParallelDb->add(spOrderedShardsTable);
+      ASSERT_EQ(0, status);
+    } else {
+      spParallelTable->reset();
+      spSerialTable->reset();
+      spShardsTable->reset();
+      spOrderedShardsTable->reset();
+    }
+    vsqlite = gParallelDb;
+  }
+  virtual void TearDown() override {
+
+  }
+
+  vsqlite::SPVSQLite vsqlite;
+  vsqlite::SimpleQueryListener listener;
+
+};
+
+static const char *IN_KEYS = "(7,3,12,5,0,999,40,41,42,43,44,45,46,47,48,49)";
+
+/*
+ * prepare() is still called once per IN value, with a single
+ * OP_EQ constraint.  Rows come back in IN list order.
+ */
+TEST_F(ParallelTest, in_list) {
+  int rv = vsqlite->query(std::string("SELECT key, val FROM tlookup WHERE key IN ") + IN_KEYS, listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(14, listener.results.size());
+  EXPECT_EQ(16, spParallelTable->_num_prepare_calls.load());
+
+  auto FKEY = listener.columnForName("key");
+  auto FVAL = listener.columnForName("val");
+  uint32_t last = 0;
+  for (auto &row : listener.results) {
+    uint32_t key = row[FKEY];
+    EXPECT_LT(last, key);
+    EXPECT_EQ(key * 2, (uint32_t)row[FVAL]);
+    last = key;
+  }
+}
+
+/*
+ * Lookups overlap for PARALLEL_LOOKUP tables only.
+ */
+TEST_F(ParallelTest, concurrent) {
+  int rv = vsqlite->query(std::string("SELECT key FROM tlookup WHERE key IN ") + IN_KEYS, listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_LT(1, spParallelTable->_max_active.load());
+
+  vsqlite::SimpleQueryListener serialListener;
+  rv = vsqlite->query(std::string("SELECT key FROM tserial WHERE key IN ") + IN_KEYS, serialListener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(14, serialListener.results.size());
+  EXPECT_EQ(1, spSerialTable->_max_active.load());
+}
+
+/*
+ * Closing the cursor early waits for lookups in flight.
+ */
+TEST_F(ParallelTest, limit) {
+  int rv = vsqlite->query(std::string("SELECT key FROM tlookup WHERE key IN ") + IN_KEYS + " LIMIT 2", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(2, listener.results.size());
+  EXPECT_EQ(3, (int)listener.results[0][listener.columnForName("key")]);
+  EXPECT_EQ(0, spParallelTable->_active.load());
+}
+
+/*
+ * Other constraints are passed to every lookup, and sqlite
+ * still handles ORDER BY.
+ */
+TEST_F(ParallelTest, other_constraints) {
+  int rv = vsqlite->query("SELECT key FROM tlookup WHERE key IN (1,2,3,4,5) AND key > 2 ORDER BY key DESC", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  auto FKEY = listener.columnForName("key");
+  EXPECT_EQ(5, (int)listener.results[0][FKEY]);
+  EXPECT_EQ(3, (int)listener.results[2][FKEY]);
+}
+
+/*
+ * A join calls xFilter once per outer row, each is a single lookup.
+ */
+TEST_F(ParallelTest, join) {
+  int rv = vsqlite->query("SELECT a.key, b.val FROM tserial a JOIN tlookup b ON b.key = a.val WHERE a.key IN (1,2,3)", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(12, (int)listener.results[2][listener.columnForName("val")]);
+}
+
+/*
+ * Partitions are scanned concurrently, every row arrives once.
+ */
+TEST_F(ParallelTest, partitions_unordered) {
+  int rv = vsqlite->query("SELECT key, val FROM tshards", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(10000, listener.results.size());
+  EXPECT_EQ(4, spShardsTable->_num_partitions.load());
+  EXPECT_LT(1, spShardsTable->_max_active.load());
+
+  auto FKEY = listener.columnForName("key");
+  auto FVAL = listener.columnForName("val");
+  std::set<uint32_t> keys;
+  for (auto &row : listener.results) {
+    uint32_t key = row[FKEY];
+    EXPECT_EQ(key * 2, (uint32_t)row[FVAL]);
+    keys.insert(key);
+  }
+  EXPECT_EQ(10000, keys.size());
+}
+
+/*
+ * Interleaved rows can't satisfy the table's orderings,
+ * sqlite sorts.
+ */
+TEST_F(ParallelTest, partitions_unordered_sort) {
+  int rv = vsqlite->query("SELECT key FROM tshards WHERE key > 2490 ORDER BY key LIMIT 20", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(20, listener.results.size());
+  auto FKEY = listener.columnForName("key");
+  for (size_t i=0; i < listener.results.size(); i++) {
+    EXPECT_EQ(2491 + i, (uint32_t)listener.results[i][FKEY]);
+  }
+}
+
+/*
+ * PARTITIONED_ORDERED serves partition 0 first, then 1, ...
+ * so the table's orderings still hold.
+ */
+TEST_F(ParallelTest, partitions_ordered) {
+  int rv = vsqlite->query("SELECT key FROM tshards_ordered ORDER BY key", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(10000, listener.results.size());
+  EXPECT_LT(1, spOrderedShardsTable->_max_active.load());
+  auto FKEY = listener.columnForName("key");
+  for (size_t i=0; i < listener.results.size(); i++) {
+    ASSERT_EQ(i + 1, (uint32_t)listener.results[i][FKEY]);
+  }
+}
+
+/*
+ * Closing the cursor early stops the partitions.
+ */
+TEST_F(ParallelTest, partitions_limit) {
+  int rv = vsqlite->query("SELECT key FROM tshards LIMIT 5", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(5, listener.results.size());
+  EXPECT_EQ(0, spShardsTable->_active.load());
+}
+
+/*
+ * The table decides when to partition, a lookup is not split.
+ */
+TEST_F(ParallelTest, partitions_lookup) {
+  int rv = vsqlite->query("SELECT key, val FROM tshards WHERE key = 4000", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(8000, (int)listener.results[0][listener.columnForName("val")]);
+  EXPECT_EQ(1, spShardsTable->_num_prepare_calls.load());
+  EXPECT_EQ(0, spShardsTable->_num_partitions.load());
+}
@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "table_numbers.h"
+
+static uint32_t gCount = 0;
+static vsqlite::SPVSQLite gPipelineDb;
+static std::shared_ptr<TNumbersTable> spPipeTable;
+static std::shared_ptr<TNumbersTable> spPipeTable2;
+
+class PipelineTest : public ::testing::Test {
+protected:
+  virtual void SetUp() override {
+
+    if (gCount++ == 0) {
+      gPipelineDb = vsqlite::VSQLiteNew();
+
+      spPipeTable = std::make_shared<TNumbersTable>("tpipe", 1000, 1000);
+      spPipeTable->tableDef().table_attrs = { "PIPELINE" };
+      int status = gPipelineDb->add(spPipeTable);
+      ASSERT_EQ(0, status);
+
+      // TNumbersTable counters are not thread-safe, use
+      // another instance for concurrent cursors
+      spPipeTable2 = std::make_shared<TNumbersTable>("tpipe2", 1000, 1000);
+      spPipeTable2->tableDef().table_attrs = { "PIPELINE" };
+      status = gPipelineDb->add(spPipeTable2);
+      ASSERT_EQ(0, status);
+    } else {
+      spPipeTable->reset();
+      spPipeTable2->reset();
+    }
+    vsqlite = gPipelineDb;
+  }
+  virtual void TearDown() override {
+
+  }
+
+  vsqlite::SPVSQLite vsqlite;
+  vsqlite::SimpleQueryListener listener;
+
+};
+
+/*
+ * prepare() and next() run on a worker thread,
+ * rows arrive in order.
+ */
+TEST_F(PipelineTest, select_all) {
+  int rv = vsqlite->query("SELECT id, val FROM tpipe", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1000, listener.results.size());
+  EXPECT_NE(std::this_thread::get_id(), spPipeTable->_last_thread);
+
+  auto FID = listener.columnForName("id");
+  for (size_t i=0; i < listener.results.size(); i++) {
+    ASSERT_EQ(i + 1, (int)listener.results[i][FID]);
+  }
+}
+
+/*
+ * sqlite stops reading early, the worker is cancelled
+ * before producing every row.
+ */
+TEST_F(PipelineTest, cancel_on_close) {
+  int rv = vsqlite->query("SELECT id FROM tpipe WHERE val > 20 LIMIT 3", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(3, (int)listener.results[0][listener.columnForName("id")]);
+  EXPECT_LT(spPipeTable->_num_next_calls, 1000);
+}
+
+/*
+ * Each xFilter of a join restarts the cursor's worker with new
+ * constraints, on the same thread.
+ */
+TEST_F(PipelineTest, refilter) {
+  int rv = vsqlite->query("SELECT a.id, b.val FROM tpipe a JOIN tpipe2 b ON b.id = a.id WHERE a.id < 6", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(5, listener.results.size());
+  EXPECT_EQ(50, (int)listener.results[4][listener.columnForName("val")]);
+  EXPECT_EQ(5, spPipeTable2->_num_prepare_calls);
+  EXPECT_EQ(5, spPipeTable2->_max_thread_prepares);
+}
@@ -0,0 +1,728 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "table_numbers.h"
+#include "table_userfiles.h"
+#include "table_wide.h"
+
+static uint32_t gCount = 0;
+static vsqlite::SPVSQLite gPlannerDb;
+static std::shared_ptr<TNumbersTable> spBigTable;
+static std::shared_ptr<TNumbersTable> spSmallTable;
+static std::shared_ptr<TNumbersTable> spExactTable;
+static std::shared_ptr<TNumbersTable> spBatchTable;
+static std::shared_ptr<TNumbersTable> spRangeTable;
+static std::shared_ptr<TNumbersTable> spNullableTable;
+static std::shared_ptr<TUserFilesTable> spUserFilesTable;
+static std::shared_ptr<TWideTable> spWideTable;
+static std::shared_ptr<TNumbersTable> spAutoIndexTable;
+static std::shared_ptr<TNumbersTable> spOuterTable;
+static std::shared_ptr<TNumbersTable> spCacheTable;
+
+/*
+ * Count comparison opcodes in the sqlite program for sql.
+ * If vsqlite sets 'omit' on a constraint, sqlite does not
+ * generate a check for it.
+ */
+static int countComparisons(vsqlite::SPVSQLite db, std::string sql) {
+  vsqlite::SimpleQueryListener listener;
+  db->query("EXPLAIN " + sql, listener);
+  auto FOPCODE = listener.columnForName("opcode");
+  int count = 0;
+  for (auto &row : listener.results) {
+    std::string opcode = row[FOPCODE].as_s();
+    if (opcode == "Eq" || opcode == "Ne") {
+      count++;
+    }
+  }
+  return count;
+}
+
+class PlannerTest : public ::testing::Test {
+protected:
+  virtual void SetUp() override {
+
+    if (gCount++ == 0) {
+      gPlannerDb = vsqlite::VSQLiteNew();
+
+      spBigTable = std::make_shared<TNumbersTable>("tbig", 200, 1000000);
+      int status = gPlannerDb->add(spBigTable);
+      ASSERT_EQ(0, status);
+
+      spSmallTable = std::make_shared<TNumbersTable>("tsmall", 10, 10);
+      status = gPlannerDb->add(spSmallTable);
+      ASSERT_EQ(0, status);
+
+      spExactTable = std::make_shared<TNumbersTable>("texact", 10, 10, true);
+      status = gPlannerDb->add(spExactTable);
+      ASSERT_EQ(0, status);
+
+      spBatchTable = std::make_shared<TNumbersTable>("tbatch", 10, 10, false, vsqlite::ColOpt::BATCH_IN);
+      status = gPlannerDb->add(spBatchTable);
+      ASSERT_EQ(0, status);
+
+      spRangeTable = std::make_shared<TNumbersTable>("trange", 10, 10);
+      spRangeTable->idColumn().indexOpsImplemented = {
+        vsqlite::OP_EQ, vsqlite::OP_GT, vsqlite::OP_GE, vsqlite::OP_LT, vsqlite::OP_LE,
+        vsqlite::OP_NE, vsqlite::OP_IS, vsqlite::OP_ISNOT };
+      status = gPlannerDb->add(spRangeTable);
+      ASSERT_EQ(0, status);
+
+      // id is part of the primary key, so sqlite treats it as NOT NULL.
+      // Use a secondary index on val for IS NULL / IS NOT NULL.
+      spNullableTable = std::make_shared<TNumbersTable>("tnullable", 10, 10);
+      spNullableTable->tableDef().indexes = { { { spNullableTable->FVAL }, 0, 0 } };
+      spNullableTable->tableDef().columns[1].indexOpsImplemented = {
+        vsqlite::OP_ISNULL, vsqlite::OP_ISNOTNULL };
+      status = gPlannerDb->add(spNullableTable);
+      ASSERT_EQ(0, status);
+
+      spUserFilesTable = std::make_shared<TUserFilesTable>();
+      status = gPlannerDb->add(spUserFilesTable);
+      ASSERT_EQ(0, status);
+
+      spWideTable = std::make_shared<TWideTable>(100, 3);
+      status = gPlannerDb->add(spWideTable);
+      ASSERT_EQ(0, status);
+
+      spAutoIndexTable = std::make_shared<TNumbersTable>("tauto", 100, 100);
+      spAutoIndexTable->tableDef().table_attrs = { "AUTO_INDEX" };
+      status = gPlannerDb->add(spAutoIndexTable);
+      ASSERT_EQ(0, status);
+
+      spOuterTable = std::make_shared<TNumbersTable>("touter", 20, 20);
+      status = gPlannerDb->add(spOuterTable);
+      ASSERT_EQ(0, status);
+
+      spCacheTable = std::make_shared<TNumbersTable>("tcache", 10, 10);
+      spCacheTable->tableDef().table_attrs = { "CACHEABLE" };
+      status = gPlannerDb->add(spCacheTable);
+      ASSERT_EQ(0, status);
+    } else {
+      spBigTable->reset();
+      spSmallTable->reset();
+      spExactTable->reset();
+      spBatchTable->reset();
+      spRangeTable->reset();
+      spNullableTable->reset();
+      spUserFilesTable->reset();
+      spAutoIndexTable->reset();
+      spOuterTable->reset();
+      spCacheTable->reset();
+    }
+    vsqlite = gPlannerDb;
+  }
+  virtual void TearDown() override {
+
+  }
+
+  vsqlite::SPVSQLite vsqlite;
+  vsqlite::SimpleQueryListener listener;
+
+};
+
+/*
+ * true if sqlite adds a sort step to the plan for sql
+ */
+static bool usesTempSort(vsqlite::SPVSQLite db, std::string sql) {
+  vsqlite::SimpleQueryListener listener;
+  db->query("EXPLAIN QUERY PLAN " + sql, listener);
+  auto FDETAIL = listener.columnForName("detail");
+  for (auto &row : listener.results) {
+    if (row[FDETAIL].as_s().find("TEMP B-TREE") != std::string::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Both tables are indexed on the join column.  With row estimates
+ * sqlite should scan the small table in the outer loop and do one
+ * unique lookup per row in the big table, regardless of FROM order.
+ */
+TEST_F(PlannerTest, join_order_uses_estimates) {
+
+  int rv = vsqlite->query("SELECT * FROM tbig JOIN tsmall USING (id)", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spSmallTable->_num_prepare_calls);
+  EXPECT_EQ(10 + 1, spSmallTable->_num_next_calls);
+
+  EXPECT_EQ(10, spBigTable->_num_prepare_calls);
+  EXPECT_EQ(10, spBigTable->_num_index_constraints);
+
+  EXPECT_EQ(10, listener.results.size());
+}
+
+/*
+ * texact declares OP_EQ on id as exact, so sqlite should not
+ * re-check id on the rows returned.
+ */
+TEST_F(PlannerTest, exact_constraint_omitted) {
+
+  EXPECT_LT(0, countComparisons(vsqlite, "SELECT val FROM tsmall WHERE id = 5"));
+  EXPECT_EQ(0, countComparisons(vsqlite, "SELECT val FROM texact WHERE id = 5"));
+
+  int rv = vsqlite->query("SELECT val FROM texact WHERE id = 5", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spExactTable->_num_prepare_calls);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(50, (int)listener.results[0][listener.columnForName("val")]);
+}
+
+/*
+ * TNumbersTable declares rows are ordered by id ascending.
+ * sqlite should skip the sort for ORDER BY id, but not for DESC.
+ */
+TEST_F(PlannerTest, order_by_consumed) {
+
+  EXPECT_FALSE(usesTempSort(vsqlite, "SELECT * FROM tsmall ORDER BY id"));
+  EXPECT_TRUE(usesTempSort(vsqlite, "SELECT * FROM tsmall ORDER BY id DESC"));
+  EXPECT_TRUE(usesTempSort(vsqlite, "SELECT * FROM tsmall ORDER BY val"));
+
+  int rv = vsqlite->query("SELECT id FROM tsmall ORDER BY id", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(0, spSmallTable->_last_ordering);
+  ASSERT_EQ(10, listener.results.size());
+  auto FID = listener.columnForName("id");
+  for (int i=0; i < 10; i++) {
+    EXPECT_EQ(i + 1, (int)listener.results[i][FID]);
+  }
+
+  rv = vsqlite->query("SELECT id FROM tsmall ORDER BY id DESC", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(-1, spSmallTable->_last_ordering);
+}
+
+/*
+ * LIMIT and OFFSET are only passed to prepare() as a hint when
+ * no other constraint needs to be checked by sqlite.
+ * (requires sqlite 3.38 or later)
+ */
+TEST_F(PlannerTest, limit_hint) {
+
+  int rv = vsqlite->query("SELECT * FROM texact LIMIT 3", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(3, listener.results.size());
+  EXPECT_EQ(3, spExactTable->_last_limit);
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM texact LIMIT 3 OFFSET 2", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(3, listener.results.size());
+  EXPECT_EQ(5, spExactTable->_last_limit);
+
+  // texact evaluates OP_EQ exactly
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM texact WHERE id = 4 LIMIT 3", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, listener.results.size());
+  EXPECT_EQ(3, spExactTable->_last_limit);
+
+  // sqlite filters val, so table must not stop early
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM texact WHERE val > 50 LIMIT 3", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(3, listener.results.size());
+  EXPECT_EQ(-1, spExactTable->_last_limit);
+
+  // tsmall does not evaluate OP_EQ exactly
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM tsmall WHERE id = 4 LIMIT 3", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(-1, spSmallTable->_last_limit);
+
+  // unordered output
+
+  rv = vsqlite->query("SELECT * FROM texact ORDER BY val LIMIT 3", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(-1, spExactTable->_last_limit);
+}
+
+/*
+ * tbatch declares BATCH_IN on id, so the whole IN list is
+ * passed to a single prepare() call.
+ */
+TEST_F(PlannerTest, batch_in_list) {
+
+  int rv = vsqlite->query("SELECT * FROM tsmall WHERE id IN (2,4,6,99)", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(4, spSmallTable->_num_prepare_calls);
+  EXPECT_EQ(3, listener.results.size());
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM tbatch WHERE id IN (2,4,6,99)", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spBatchTable->_num_prepare_calls);
+  EXPECT_EQ(4, spBatchTable->_num_index_constraints);
+  EXPECT_EQ(3 + 1, spBatchTable->_num_next_calls);
+  EXPECT_EQ(3, listener.results.size());
+}
+
+/*
+ * Comparison constraints on id are merged into a single range.
+ */
+TEST_F(PlannerTest, range_merged) {
+
+  int rv = vsqlite->query("SELECT * FROM trange WHERE id >= 3 AND id < 6 AND id > 3 AND id <= 8", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spRangeTable->_num_prepare_calls);
+  ASSERT_TRUE(spRangeTable->_last_range_valid);
+  EXPECT_EQ(3, spRangeTable->_last_range.lower.as_i64());
+  EXPECT_FALSE(spRangeTable->_last_range.lowerInclusive);
+  EXPECT_EQ(6, spRangeTable->_last_range.upper.as_i64());
+  EXPECT_FALSE(spRangeTable->_last_range.upperInclusive);
+
+  // only ids 4 and 5 generated
+
+  EXPECT_EQ(2 + 1, spRangeTable->_num_next_calls);
+  EXPECT_EQ(2, listener.results.size());
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM trange WHERE id <= 2", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_TRUE(spRangeTable->_last_range_valid);
+  EXPECT_FALSE(spRangeTable->_last_range.lower.valid());
+  EXPECT_EQ(2, listener.results.size());
+}
+
+/*
+ * Ranges that can't match anything never reach prepare()
+ */
+TEST_F(PlannerTest, range_empty) {
+
+  int rv = vsqlite->query("SELECT * FROM trange WHERE id > 5 AND id < 3", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(0, spRangeTable->_num_prepare_calls);
+  EXPECT_EQ(0, listener.results.size());
+
+  rv = vsqlite->query("SELECT * FROM trange WHERE id > 5 AND id <= 5", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(0, spRangeTable->_num_prepare_calls);
+  EXPECT_EQ(0, listener.results.size());
+
+  rv = vsqlite->query("SELECT * FROM trange WHERE id >= 4 AND id <= 4", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spRangeTable->_num_prepare_calls);
+  EXPECT_EQ(1, listener.results.size());
+}
+
+/*
+ * Bounds beyond 32 bits keep their full value.
+ */
+TEST_F(PlannerTest, range_int64) {
+
+  int rv = vsqlite->query("SELECT * FROM trange WHERE id >= 5 AND id <= 4294967300", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spRangeTable->_num_prepare_calls);
+  ASSERT_TRUE(spRangeTable->_last_range_valid);
+  EXPECT_EQ(4294967300LL, spRangeTable->_last_range.upper.as_i64());
+  EXPECT_EQ(6, listener.results.size());
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM trange WHERE id >= 2147483647 AND id <= 2147483648", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(2, spRangeTable->_num_prepare_calls);
+  EXPECT_EQ(2147483648LL, spRangeTable->_last_range.upper.as_i64());
+  EXPECT_EQ(0, listener.results.size());
+}
+
+/*
+ * Bounds sqlite compares with another collation, or by column
+ * affinity, are not merged, and never skip prepare().
+ */
+TEST_F(PlannerTest, range_not_merged) {
+
+  int rv = vsqlite->query("SELECT * FROM trange WHERE id > 5 COLLATE NOCASE AND id < 3", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spRangeTable->_num_prepare_calls);
+  EXPECT_FALSE(spRangeTable->_last_range_valid);
+  EXPECT_EQ(0, listener.results.size());
+
+  rv = vsqlite->query("SELECT * FROM trange WHERE id >= 3 AND id < '6'", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(2, spRangeTable->_num_prepare_calls);
+  EXPECT_FALSE(spRangeTable->_last_range_valid);
+  EXPECT_EQ(3, listener.results.size());
+}
+
+/*
+ * tuserfiles has a composite (uid, path) index.  Only a query that
+ * constrains both columns should be offered to the table as a lookup.
+ */
+TEST_F(PlannerTest, composite_index) {
+
+  int rv = vsqlite->query("SELECT * FROM tuserfiles WHERE uid = 501 AND path = '/etc/hosts'", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spUserFilesTable->_num_prepare_calls);
+  EXPECT_EQ(0, spUserFilesTable->_last_index);
+  EXPECT_EQ(2, spUserFilesTable->_num_index_constraints);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(300, (int64_t)listener.results[0][listener.columnForName("size")]);
+
+  // partial constraint is left for sqlite to filter on a full scan
+
+  spUserFilesTable->reset();
+  listener.results.clear();
+  rv = vsqlite->query("SELECT * FROM tuserfiles WHERE uid = 501", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spUserFilesTable->_num_prepare_calls);
+  EXPECT_EQ(-1, spUserFilesTable->_last_index);
+  EXPECT_EQ(0, spUserFilesTable->_num_index_constraints);
+  EXPECT_EQ(TUserFilesTable::getRawData().size() + 1, spUserFilesTable->_num_next_calls);
+  EXPECT_EQ(2, listener.results.size());
+}
+
+/*
+ * Newer constraint operators are passed through when the
+ * column lists them in indexOpsImplemented.
+ */
+TEST_F(PlannerTest, null_and_ne_ops) {
+
+  struct { const char *sql; vsqlite::ConstraintOp op; bool hasValue; std::shared_ptr<TNumbersTable> table; } cases[] = {
+    { "SELECT * FROM trange WHERE id != 3", vsqlite::OP_NE, true, spRangeTable }
+    ,{ "SELECT * FROM trange WHERE id IS NOT 3", vsqlite::OP_ISNOT, true, spRangeTable }
+    ,{ "SELECT * FROM tnullable WHERE val IS NULL", vsqlite::OP_ISNULL, false, spNullableTable }
+    ,{ "SELECT * FROM tnullable WHERE val IS NOT NULL", vsqlite::OP_ISNOTNULL, false, spNullableTable }
+  };
+
+  for (auto &tc : cases) {
+    tc.table->_last_constraints.clear();
+    int rv = vsqlite->query(tc.sql, listener);
+    ASSERT_EQ(0, rv);
+    ASSERT_EQ(1, tc.table->_last_constraints.size()) << tc.sql;
+    EXPECT_EQ(tc.op, tc.table->_last_constraints[0].op) << tc.sql;
+    EXPECT_EQ(tc.hasValue, tc.table->_last_constraints[0].value.valid()) << tc.sql;
+  }
+}
+
+/*
+ * xBestIndex plans are cached by constraint shape, so
+ * preparing the same query again does not re-plan.
+ */
+TEST_F(PlannerTest, plan_cached) {
+  const char *sql = "SELECT * FROM tsmall JOIN tbig ON tsmall.val = tbig.id WHERE tsmall.id IN (2,3)";
+  int rv = vsqlite->query(sql, listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(2, listener.results.size());
+  uint32_t numEstimates = spBigTable->_num_estimate_calls + spSmallTable->_num_estimate_calls;
+  EXPECT_LT(0, numEstimates);
+
+  listener.results.clear();
+  rv = vsqlite->query(sql, listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(2, listener.results.size());
+  EXPECT_EQ(numEstimates, spBigTable->_num_estimate_calls + spSmallTable->_num_estimate_calls);
+}
+
+/*
+ * Two cursors running the same plan at the same time
+ * each get their own context.
+ */
+TEST_F(PlannerTest, concurrent_cursors_same_plan) {
+  int rv = vsqlite->query("SELECT a.id, b.id FROM tsmall a, tsmall b", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(10 * 10, listener.results.size());
+  EXPECT_EQ(1 + 10, spSmallTable->_num_prepare_calls);
+}
+
+/*
+ * Requested columns are tracked for tables wider than
+ * sqlite's 64-bit colUsed mask.
+ */
+TEST_F(PlannerTest, wide_table_requested_columns) {
+  int rv = vsqlite->query("SELECT c1, c62 FROM twide", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(2, spWideTable->_last_requested.count());
+  EXPECT_TRUE(spWideTable->_last_requested.test(1));
+  EXPECT_TRUE(spWideTable->_last_requested.test(62));
+
+  // any column past 62 marks all of them
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT c0, c99 FROM twide", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(1 + (100 - 63), spWideTable->_last_requested.count());
+  EXPECT_TRUE(spWideTable->_last_requested.test(0));
+  EXPECT_FALSE(spWideTable->_last_requested.test(62));
+  EXPECT_TRUE(spWideTable->_last_requested.test(63));
+  EXPECT_TRUE(spWideTable->_last_requested.test(99));
+  EXPECT_EQ(2099, listener.results[2][listener.columnForName("c99")].as_i64());
+}
+
+/*
+ * The plan cache is bounded.  Plans dropped from it while a
+ * statement is being prepared are still found by its xFilter calls.
+ */
+TEST_F(PlannerTest, plan_cache_bounded) {
+  std::string sql = "SELECT c0 AS v FROM twide";
+  for (int i=1; i < 63; i++) {
+    sql += " UNION ALL SELECT c" + std::to_string(i) + " FROM twide";
+    sql += " UNION ALL SELECT c0 + c" + std::to_string(i) + " FROM twide";
+  }
+  for (int run=0; run < 2; run++) {
+    listener.results.clear();
+    int rv = vsqlite->query(sql, listener);
+    ASSERT_EQ(0, rv);
+    EXPECT_EQ((1 + 62 * 2) * 3, listener.results.size());
+  }
+}
+
+/*
+ * state<T>() is reused across the prepare() calls of an
+ * IN lookup, and reset for each one.
+ */
+TEST_F(PlannerTest, pooled_state) {
+  int rv = vsqlite->query("SELECT * FROM tsmall WHERE id IN (2,3,4)", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(3, spSmallTable->_num_prepare_calls);
+  EXPECT_EQ(1, spSmallTable->_state_ptrs.size());
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(40, (int)listener.results[2][listener.columnForName("val")]);
+
+  // pooled with the context, without the last lookup's ids
+
+  for (auto pState : spSmallTable->_state_ptrs) {
+    EXPECT_TRUE(pState->_ids.empty());
+  }
+}
+
+/*
+ * Row slots are reused between rows, columns not set for
+ * a row must read as NULL.
+ */
+TEST_F(PlannerTest, row_slots_reset) {
+  int rv = vsqlite->query("SELECT c1, c2, c2 IS NULL AS missing FROM twide", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  auto FC2 = listener.columnForName("c2");
+  auto FMISSING = listener.columnForName("missing");
+  EXPECT_EQ(2, (int)listener.results[0][FC2]);
+  EXPECT_EQ(0, (int)listener.results[0][FMISSING]);
+  EXPECT_EQ(1, (int)listener.results[1][FMISSING]);
+  EXPECT_EQ(2002, (int)listener.results[2][FC2]);
+  EXPECT_EQ(0, (int)listener.results[2][FMISSING]);
+}
+
+/*
+ * count(*) reads no columns, rows can be returned empty.
+ */
+TEST_F(PlannerTest, count_only) {
+  int rv = vsqlite->query("SELECT count(*) AS n FROM tsmall", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(10, (int)listener.results[0][listener.columnForName("n")]);
+  EXPECT_EQ(10, spSmallTable->_num_count_only_rows);
+
+  listener.results.clear();
+  spSmallTable->reset();
+  rv = vsqlite->query("SELECT count(val) AS n FROM tsmall", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(10, (int)listener.results[0][listener.columnForName("n")]);
+  EXPECT_EQ(0, spSmallTable->_num_count_only_rows);
+}
+
+/*
+ * LAZY columns are computed only for rows sqlite reads them
+ * from, once per row.
+ */
+TEST_F(PlannerTest, lazy_column) {
+  int rv = vsqlite->query("SELECT path, hash FROM tuserfiles WHERE size > 200", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(3, spUserFilesTable->_num_hash_calls);
+  EXPECT_EQ("hash:/etc/passwd", listener.results[0][listener.columnForName("hash")].as_s());
+
+  // read twice per row, computed once
+
+  listener.results.clear();
+  spUserFilesTable->reset();
+  rv = vsqlite->query("SELECT hash FROM tuserfiles WHERE hash LIKE '%profile'", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(2, listener.results.size());
+  EXPECT_EQ(5, spUserFilesTable->_num_hash_calls);
+
+  // not read, not computed
+
+  listener.results.clear();
+  spUserFilesTable->reset();
+  rv = vsqlite->query("SELECT path FROM tuserfiles", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(5, listener.results.size());
+  EXPECT_EQ(0, spUserFilesTable->_num_hash_calls);
+}
+
+/*
+ * A join on an unindexed column of an AUTO_INDEX table scans it
+ * for the first outer row, and once more to build the transient
+ * index the later outer rows are looked up in.
+ */
+TEST_F(PlannerTest, auto_index_join) {
+  int rv = vsqlite->query("SELECT a.id, b.id AS bid FROM touter a JOIN tauto b ON b.val = a.val", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(20, listener.results.size());
+  auto FID = listener.columnForName("id");
+  auto FBID = listener.columnForName("bid");
+  for (auto &row : listener.results) {
+    EXPECT_EQ((uint32_t)row[FID], (uint32_t)row[FBID]);
+  }
+  EXPECT_EQ(2, spAutoIndexTable->_num_prepare_calls);
+  EXPECT_EQ(2 * 101, spAutoIndexTable->_num_next_calls);
+  EXPECT_TRUE(spAutoIndexTable->_last_constraints.empty());
+
+  // not kept after the statement
+
+  listener.results.clear();
+  spAutoIndexTable->reset();
+  rv = vsqlite->query("SELECT a.id FROM touter a JOIN tauto b ON b.val = a.val WHERE a.id < 5", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(4, listener.results.size());
+  EXPECT_EQ(2, spAutoIndexTable->_num_prepare_calls);
+}
+
+/*
+ * Joins sqlite compares with another collation than BINARY
+ * are not indexed, each lookup scans the table.
+ */
+TEST_F(PlannerTest, auto_index_collation) {
+  int rv = vsqlite->query("SELECT a.id FROM touter a JOIN tauto b ON b.val = a.val COLLATE NOCASE WHERE a.id < 4", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(3, spAutoIndexTable->_num_prepare_calls);
+}
+
+/*
+ * Runs a nested query for every row, like a listener
+ * that looks up details of each result.
+ */
+struct NestedQueryListener : public vsqlite::SimpleQueryListener {
+  NestedQueryListener(vsqlite::SPVSQLite db, const std::string &sql) : _db(db), _sql(sql) {}
+  vsqlite::TLStatus onResultRow(DynMap &row) override {
+    vsqlite::SimpleQueryListener inner;
+    _db->query(_sql, inner);
+    innerRows += inner.results.size();
+    return vsqlite::SimpleQueryListener::onResultRow(row);
+  }
+  vsqlite::SPVSQLite _db;
+  std::string _sql;
+  size_t innerRows {0};
+};
+
+/*
+ * A transient index belongs to the statement that built it.
+ * A statement run from a listener callback builds its own.
+ */
+TEST_F(PlannerTest, auto_index_per_statement) {
+  std::string sql = "SELECT a.id FROM touter a JOIN tauto b ON b.val = a.val WHERE a.id < 3";
+  NestedQueryListener nested(vsqlite, sql);
+  int rv = vsqlite->query(sql, nested);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(2, nested.results.size());
+  EXPECT_EQ(2 * 2, nested.innerRows);
+  EXPECT_EQ(2 + 2 * 2, spAutoIndexTable->_num_prepare_calls);
+}
+
+/*
+ * Constant values are left to the table, a scan is
+ * no cheaper than building the index.
+ */
+TEST_F(PlannerTest, auto_index_constant) {
+  int rv = vsqlite->query("SELECT id FROM tauto WHERE val = 500", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(50, (int)listener.results[0][listener.columnForName("id")]);
+  EXPECT_EQ(1, spAutoIndexTable->_num_prepare_calls);
+  EXPECT_TRUE(spAutoIndexTable->_last_constraints.empty());
+}
+
+/*
+ * A value sqlite only knows at xFilter, like a bound parameter,
+ * is looked up once.  That scan doesn't build an index.
+ */
+TEST_F(PlannerTest, auto_index_single_lookup) {
+  int rv = vsqlite->query("SELECT id FROM tauto WHERE val = abs(500)", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(50, (int)listener.results[0][listener.columnForName("id")]);
+  EXPECT_EQ(1, spAutoIndexTable->_num_prepare_calls);
+  EXPECT_FALSE(spAutoIndexTable->_last_row_needed);
+}
+
+/*
+ * Values of another type class than the column fall back
+ * to a scan, sqlite's comparison decides.
+ */
+TEST_F(PlannerTest, auto_index_type_mismatch) {
+  int rv = vsqlite->query("SELECT a.id FROM touter a JOIN tauto b ON b.val = CAST(a.val AS TEXT) WHERE a.id < 4", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+}
+
+/*
+ * A correlated subquery rescans CACHEABLE tables from the
+ * statement's snapshot.  The next statement scans again.
+ */
+TEST_F(PlannerTest, cacheable_subquery) {
+  int rv = vsqlite->query("SELECT a.id, (SELECT max(b.id) FROM tcache b WHERE b.val <= a.val) AS m FROM touter a", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(20, listener.results.size());
+  auto FM = listener.columnForName("m");
+  EXPECT_EQ(1, (int)listener.results[0][FM]);
+  EXPECT_EQ(3, (int)listener.results[2][FM]);
+  EXPECT_EQ(10, (int)listener.results[19][FM]);
+  EXPECT_EQ(1, spCacheTable->_num_prepare_calls);
+  EXPECT_EQ(11, spCacheTable->_num_next_calls);
+
+  listener.results.clear();
+  spCacheTable->reset();
+  rv = vsqlite->query("SELECT a.id, (SELECT max(b.id) FROM tcache b WHERE b.val <= a.val) AS m FROM touter a", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(20, listener.results.size());
+  EXPECT_EQ(1, spCacheTable->_num_prepare_calls);
+}
+
+/*
+ * Lookups are kept per constraint value.
+ */
+TEST_F(PlannerTest, cacheable_lookup) {
+  int rv = vsqlite->query("SELECT a.id, b.val FROM touter a JOIN tcache b ON b.id = (a.id % 5) + 1", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(20, listener.results.size());
+  auto FID = listener.columnForName("id");
+  auto FVAL = listener.columnForName("val");
+  for (auto &row : listener.results) {
+    EXPECT_EQ((((uint32_t)row[FID] % 5) + 1) * 10, (uint32_t)row[FVAL]);
+  }
+  EXPECT_EQ(5, spCacheTable->_num_prepare_calls);
+}
+
+/*
+ * Values that only differ beyond 32 bits are different scans.
+ */
+TEST_F(PlannerTest, cacheable_lookup_int64) {
+  int rv = vsqlite->query("SELECT (SELECT count(*) FROM tcache WHERE id = 5) AS a, (SELECT count(*) FROM tcache WHERE id = 4294967301) AS b", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(1, (int)listener.results[0][listener.columnForName("a")]);
+  EXPECT_EQ(0, (int)listener.results[0][listener.columnForName("b")]);
+  EXPECT_EQ(2, spCacheTable->_num_prepare_calls);
+}
+
+/*
+ * Scans sqlite stops early are not kept.
+ */
+TEST_F(PlannerTest, cacheable_partial_scan) {
+  int rv = vsqlite->query("SELECT a.id, coalesce((SELECT b.id FROM tcache b WHERE b.val > a.val LIMIT 1), 0) AS nxt FROM touter a", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(20, listener.results.size());
+  auto FNXT = listener.columnForName("nxt");
+  EXPECT_EQ(2, (int)listener.results[0][FNXT]);
+  EXPECT_EQ(10, (int)listener.results[8][FNXT]);
+  EXPECT_EQ(0, (int)listener.results[9][FNXT]);
+  EXPECT_LT(1, spCacheTable->_num_prepare_calls);
+}
@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "table_shards.h"
+
+static uint32_t gCount = 0;
+static vsqlite::SPVSQLite gPrefetchDb;
+static std::shared_ptr<TShardsTable> spTable1;
+static std::shared_ptr<TShardsTable> spTable2;
+static std::shared_ptr<TShardsTable> spTable3;
+
+class PrefetchTest : public ::testing::Test {
+protected:
+  virtual void SetUp() override {
+
+    if (gCount++ == 0) {
+      gPrefetchDb = vsqlite::VSQLiteNew();
+
+      spTable1 = std::make_shared<TShardsTable>("tpf1", 1, 10, 20, std::vector<std::string>{ "PREFETCH" });
+      spTable2 = std::make_shared<TShardsTable>("tpf2", 1, 10, 20, std::vector<std::string>{ "PREFETCH" });
+      spTable3 = std::make_shared<TShardsTable>("tpf3", 1, 10, 20, std::vector<std::string>{ "PREFETCH" });
+      for (auto &spTable : { spTable1, spTable2, spTable3 }) {
+        int status = gPrefetchDb->add(spTable);
+        ASSERT_EQ(0, status);
+      }
+    } else {
+      spTable1->reset();
+      spTable2->reset();
+      spTable3->reset();
+    }
+    vsqlite = gPrefetchDb;
+  }
+  virtual void TearDown() override {
+
+  }
+
+  vsqlite::SPVSQLite vsqlite;
+  vsqlite::SimpleQueryListener listener;
+
+};
+
+/*
+ * Independent scans of all three tables start before sqlite
+ * reads any of them.
+ */
+TEST_F(PrefetchTest, independent_scans) {
+  int rv = vsqlite->query("SELECT a.key, b.key, c.val FROM tpf1 a, tpf2 b, tpf3 c WHERE a.key < 3 AND b.key < 3 AND c.key < 3", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(8, listener.results.size());
+  EXPECT_TRUE(spTable1->preparedElsewhere());
+  EXPECT_TRUE(spTable2->preparedElsewhere());
+  EXPECT_TRUE(spTable3->preparedElsewhere());
+}
+
+/*
+ * A single scan is not prefetched.
+ */
+TEST_F(PrefetchTest, single_scan) {
+  int rv = vsqlite->query("SELECT key FROM tpf1", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(10, listener.results.size());
+  EXPECT_FALSE(spTable1->preparedElsewhere());
+}
+
+/*
+ * Lookups depend on the outer row, only the outer
+ * scan is unconstrained.
+ */
+TEST_F(PrefetchTest, lookup_not_prefetched) {
+  int rv = vsqlite->query("SELECT a.key, b.val FROM tpf1 a JOIN tpf2 b ON b.key = a.key", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(10, listener.results.size());
+  EXPECT_EQ(20, (int)listener.results[9][listener.columnForName("val")]);
+  EXPECT_FALSE(spTable1->preparedElsewhere());
+  EXPECT_FALSE(spTable2->preparedElsewhere());
+}
+
+/*
+ * Scans no cursor used are cancelled with the statement.
+ */
+TEST_F(PrefetchTest, unused_scans) {
+  int rv = vsqlite->query("SELECT a.key FROM tpf1 a, tpf2 b LIMIT 1", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, listener.results.size());
+
+  rv = vsqlite->query("SELECT count(*) AS n FROM tpf1 a, tpf2 b WHERE a.key > 100", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(2, listener.results.size());
+  EXPECT_EQ(0, (int)listener.results[1][listener.columnForName("n")]);
+  EXPECT_EQ(0, spTable2->_active.load());
+}
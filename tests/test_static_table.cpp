@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <new>
+
+#include "table_static.h"
+
+static uint32_t gCount = 0;
+static std::shared_ptr<TStaticFilesTable> spTable;
+static std::shared_ptr<TStaticFilesTable> spPipelineTable;
+static std::shared_ptr<TStaticFilesTable> spAutoIndexTable;
+static std::shared_ptr<TStaticFilesTable> spBigTable;
+
+class StaticTableTest : public ::testing::Test {
+protected:
+  virtual void SetUp() override {
+
+    vsqlite = vsqlite::VSQLiteInstance();
+
+    if (gCount++ == 0) {
+      spTable = std::make_shared<TStaticFilesTable>();
+      int status = vsqlite->add(spTable);
+      ASSERT_EQ(0, status);
+
+      spPipelineTable = std::make_shared<TStaticFilesTable>("tstatic_pipe", std::vector<std::string>{ "PIPELINE", "CACHEABLE" });
+      status = vsqlite->add(spPipelineTable);
+      ASSERT_EQ(0, status);
+
+      spAutoIndexTable = std::make_shared<TStaticFilesTable>("tstatic_auto", std::vector<std::string>{ "AUTO_INDEX" });
+      status = vsqlite->add(spAutoIndexTable);
+      ASSERT_EQ(0, status);
+
+      spBigTable = std::make_shared<TStaticFilesTable>("tstatic_big", std::vector<std::string>{ "AUTO_INDEX" }, std::vector<StaticFileRow>{
+        {1, "/big/a", 5000000000LL, 1.0}
+        ,{2, "/big/b", 5000000001LL, 1.0}
+        ,{3, "/big/c", 5000000002LL, 1.0}
+      });
+      status = vsqlite->add(spBigTable);
+      ASSERT_EQ(0, status);
+    }
+    spTable->_num_generate_calls = 0;
+  }
+  virtual void TearDown() override {
+
+  }
+
+  vsqlite::SPVSQLite vsqlite;
+  vsqlite::SimpleQueryListener listener;
+
+};
+
+/*
+ * Schema is generated from member types.
+ */
+TEST_F(StaticTableTest, schema) {
+  const vsqlite::TableDef &td = spTable->getTableDef();
+  ASSERT_EQ(4, td.columns.size());
+  EXPECT_EQ("uid", td.columns[0].id->name);
+  EXPECT_EQ(TUINT32, td.columns[0].id->typeId);
+  EXPECT_EQ(vsqlite::ColOpt::INDEXED, td.columns[0].options);
+  EXPECT_EQ(TSTRING, td.columns[1].id->typeId);
+  EXPECT_EQ(TINT64, td.columns[2].id->typeId);
+  EXPECT_EQ(TFLOAT64, td.columns[3].id->typeId);
+}
+
+/*
+ * TableDef hints the table leaves unset read as 0,
+ * even when the table's memory was not zeroed.
+ */
+TEST_F(StaticTableTest, estimate_unset) {
+  void *p = ::operator new(sizeof(TStaticFilesTable));
+  volatile unsigned char *bytes = (volatile unsigned char *)p;
+  for (size_t i=0; i < sizeof(TStaticFilesTable); i++) {
+    bytes[i] = 0xAB;
+  }
+  auto pTable = new (p) TStaticFilesTable("tstatic_unset");
+  EXPECT_EQ(0, pTable->getTableDef().estimatedRows);
+  pTable->~TStaticFilesTable();
+  ::operator delete(p);
+}
+
+/*
+ * Column specs must match the fields one to one.
+ */
+TEST_F(StaticTableTest, bad_specs) {
+  auto spBad = std::make_shared<TBadSpecsTable>();
+  EXPECT_TRUE(spBad->getTableDef().columns.empty());
+  EXPECT_NE(0, vsqlite->add(spBad));
+}
+
+TEST_F(StaticTableTest, select_all) {
+  int rv = vsqlite->query("SELECT * FROM tstatic", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(1, spTable->_num_generate_calls);
+  ASSERT_EQ(3, listener.results.size());
+
+  auto &row = listener.results[2];
+  EXPECT_EQ(501, (int)row[listener.columnForName("uid")]);
+  EXPECT_EQ("/home/bob/.profile", row[listener.columnForName("path")].as_s());
+  EXPECT_EQ(88, row[listener.columnForName("size")].as_i64());
+  EXPECT_EQ(1.5, row[listener.columnForName("ratio")].as_double());
+}
+
+TEST_F(StaticTableTest, indexed) {
+  int rv = vsqlite->query("SELECT path FROM tstatic WHERE uid IN (0, 7)", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(2, spTable->_num_generate_calls);
+  ASSERT_EQ(2, listener.results.size());
+  EXPECT_EQ("/etc/passwd", listener.results[0][listener.columnForName("path")].as_s());
+}
+
+TEST_F(StaticTableTest, count) {
+  int rv = vsqlite->query("SELECT count(*) AS n FROM tstatic WHERE size > 100", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(1, listener.results.size());
+  EXPECT_EQ(2, (int)listener.results[0][listener.columnForName("n")]);
+}
+
+/*
+ * Rows vsqlite buffers or indexes are read from the Row,
+ * which nextRow() fills for those scans.
+ */
+TEST_F(StaticTableTest, row_needed) {
+  int rv = vsqlite->query("SELECT * FROM tstatic_pipe", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(501, (int)listener.results[2][listener.columnForName("uid")]);
+  EXPECT_EQ("/home/bob/.profile", listener.results[2][listener.columnForName("path")].as_s());
+
+  listener.results.clear();
+  rv = vsqlite->query("SELECT a.path, b.ratio FROM tstatic a JOIN tstatic_auto b ON b.size = a.size", listener);
+  ASSERT_EQ(0, rv);
+  ASSERT_EQ(3, listener.results.size());
+  EXPECT_EQ(2, spAutoIndexTable->_num_generate_calls);
+  EXPECT_EQ(1.5, listener.results[2][listener.columnForName("ratio")].as_double());
+}
+
+/*
+ * Join values beyond 32 bits find their rows in the transient index.
+ */
+TEST_F(StaticTableTest, auto_index_int64) {
+  int rv = vsqlite->query("SELECT a.path FROM tstatic_big a JOIN tstatic_big b ON b.size = a.size", listener);
+  ASSERT_EQ(0, rv);
+  EXPECT_EQ(3, listener.results.size());
+}
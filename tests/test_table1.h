@@ -65,7 +65,7 @@ public:
 
     // gather filter constraints
 
-    for (auto constraint : context->getConstraints()) {
+    for (auto &constraint : context->getConstraintSpan()) {
       if (constraint.columnId == FU32VAL && constraint.op == vsqlite::OP_EQ) {
         spState->_wantedIds.insert(constraint.value);
         _num_index_constraints++;
@@ -74,9 +74,10 @@ public:
 
     // optimize: check which columns are being requested
 
-    if (context->getRequestedColumns().count(FLONGO) == 0) {
+    if (!context->isColumnRequested(FLONGO)) {
       spState->_wantsAllFields = false;
     }
+    _alias_requested = context->isColumnRequested(FU32VAL_ALIAS);
 
     // filter our data
     if (spState->_wantedIds.empty()) {
@@ -133,11 +134,13 @@ public:
     _num_next_calls = 0;
     _num_prepare_calls = 0;
     _num_index_constraints = 0;
+    _alias_requested = false;
   }
 
   uint32_t _num_prepare_calls {0};
   uint32_t _num_next_calls {0};
   uint32_t _num_index_constraints {0};
+  bool _alias_requested {false};  // isColumnRequested(FU32VAL_ALIAS) in last prepare()
 
 private:
 